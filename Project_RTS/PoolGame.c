@@ -6,37 +6,35 @@
 
 // Standard libraries
 #include <stdlib.h>             
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <math.h>
 #include <pthread.h>
 #include <sched.h>
 #include <allegro.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <unistd.h>
 
 // My ptask library
 #include "ptask.h"              
 
+// Table physics library
+#include "physics.h"
+
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // PHYSIC CONSTANTS
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 #define     N_BALLS     16          // number of balls in the game
-#define     N_HOLES     6           // number of holes in the table
-#define     DIAM        0.055       // radius of a ball [m]
+#define     STRESS_SP   1.25        // spacing of the extra balls in stress mode [diameters]
 #define     WLEN        100         // wake lenght for trail depiction
-
-#define     LX          1.77        // width of field in x direction [m]
-#define     LY          0.85        // width of field in y direction [m]
-#define     HC          0.035       // parameter that defines holes position [m]
-#define     HP          0.065       // parameter that defines the gap in the table bounds [m]
-
-#define     B0SX        0.425       // white ball spawn coordinate x [m]
-#define     B0SY        0.425       // white ball spawn coordinate y [m]
-#define     B1SX        1.345       // ball 1 spawn coordinate x [m]
-#define     B1SY        0.425       // ball 1 spawn coordinate y [m]
-#define     B1EX        1.94        // ball 1 eliminated coordinate x [m]
-#define     B1EY        0           // ball 1 eliminated coordinate y [m]
+#define     TRAIL_STEP  1           // minimum displacement between two wake points [pixels]
 
 #define     PER         40          // ball task period [ms]
+#define     DISP_PER    16          // display task period [ms], independent of PER: positions are interpolated
+#define     N_TASKS     8           // ball, shot, display, set param, manage, HUD, capture and preview tasks
 
 #define     D_VEL       0.01        // velocity variation in shot regulation [m/s]
 #define     V_MAX       2           // maximum shot velocity [m/s]
@@ -59,6 +57,36 @@
 #define     IN_HEI      200         // shot power indicator height
 #define     DIAM_P      22          // radius of the ball in pixels
 #define     CF          400         // m to pixels ratio
+#define     MAX_DIRTY   4096        // dirty rectangles of a frame, past that the whole table is redrawn
+#define     AIM_SEG     32          // length of the aim line pieces with their own dirty rectangle [pixels]
+#define     HUD_PER     100         // HUD task period [ms]
+#define     N_HUD       7           // lines of the task statistics panel, two tasks a line
+#define     BENCH_AIM   10          // frames spent aiming each shot in the headless benchmark
+#define     CAP_LEN     8           // frames of the capture ring buffer
+#define     CAP_PER     50          // capture task period [ms]
+#define     CAP_TASK    6           // capture task index, after the game tasks
+#define     CAP_EVERY   3           // one frame captured every CAP_EVERY frames shown (about 21 per second)
+#define     CAP_MAX     3000        // most frames captured, about 7 GB and two and a half minutes
+#define     PREV_PER    100         // shot preview task period [ms]
+#define     PREV_TASK   7           // shot preview task index
+#define     PREV_STEPS  500         // longest shot preview [ball task periods]
+#define     PATH_LEN    64          // points of a ball path in the shot preview
+#define     PATH_STEP   6           // minimum distance between two points of a path [pixels]
+
+// Drawing commands, queued by the tasks and executed by the display task on the frame
+#define     DQ_LEN      256         // length of the command queue
+#define     CMD_LEN     128         // longest text of a command
+#define     CMD_TEXT    0           // text at (x0, y0)
+#define     CMD_CENTRE  1           // text centred on x0
+#define     CMD_RECT    2           // rectangle outline from (x0, y0) to (x1, y1)
+#define     CMD_FILL    3           // filled rectangle
+#define     CMD_CIRCLE  4           // circle outline of centre (x0, y0) and radius x1
+#define     CMD_DISC    5           // filled circle
+#define     CMD_SPRITE  6           // sprite with top left corner at (x0, y0)
+#define     CMD_FULL    7           // redraw the whole table, to erase what was drawn on it
+#define     CMD_HIDE    8           // hide the mouse pointer
+#define     CMD_SHOW    9           // show the mouse pointer again
+#define     CMD_ERASE   10          // redraw the table from (x0, y0) to (x1, y1), to erase what was drawn there
 
 // Colors
 #define     BLACK       0
@@ -77,34 +105,103 @@
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // STRUCTURES
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Ball status and features structure
+// Ball features structure (the physical state lives in the table state)
 struct  status {
-        float   x, y;           // Position [m]
-        float   vx, vy;         // Velocity [m/s]
         int     tcol;           // trail color
         BITMAP* bm;             // relative bitmap
-        float   xo, yo;         // ball position when it gets eliminated [m]
-        int     active_flag;    // determines if a ball is active (1) or not (0)
+        RLE_SPRITE* rle;        // bm as RLE sprite, the one drawn
         int     type;           // determines the type of the ball: 0 = solid, 1 = striped
         int     el_ph;          // phase in which the ball was eliminated
 };
-struct status ball[N_BALLS]; // Array for ball states
-
+struct status ball[SIM_MAX_BALLS]; // Array for ball features
+
+// Paths of the balls in a shot preview, in pixels of the table bitmap
+struct  path {
+        long    seq;                    // preview number, 0 for none
+        float   theta, v;               // shot previewed
+        unsigned long moves;            // table.moves of the table it starts from
+        int     n[N_BALLS];             // points of each path, 0 if the ball does not move
+        short   x[N_BALLS][PATH_LEN];   // x coordinates
+        short   y[N_BALLS][PATH_LEN];   // y coordinates
+};
 
-// Holes structure
-struct  holes {
-        float   x, y;   // hole position [m]
+// Ball positions published by the ball task after each step, interpolated by the display task
+struct  snap {
+        long    t;                  // publishing time [us]
+        float   dt;                 // step integrated before publishing [s]
+        float   x[SIM_MAX_BALLS];   // ball x coordinates [m]
+        float   y[SIM_MAX_BALLS];   // ball y coordinates [m]
+};
+struct  snap    snap[2];            // the last two states
+int     snap_last = 0;              // index of the newest state
+
+// Table and ball art, loaded once in an atlas in the screen pixel format
+struct  sprites {
+        BITMAP*     atlas;              // table on top, balls in a row below it
+        BITMAP*     cell[N_BALLS];      // ball bitmaps in the atlas
+        BITMAP*     bm[N_BALLS];        // ball bitmaps at the scale of the drawn table
+        RLE_SPRITE* rle[N_BALLS];       // RLE sprites of bm
+        float       k;                  // table scale factor bm has been made for, 0 before the first
 };
-struct  holes   hole[N_HOLES];
+struct sprites art;
+
+// Table physical state (positions, velocities, holes)
+struct  sim_state   table;
 
 
-// Circular buffer that stores wake for trail depiction
+// Circular buffer that stores wake for trail depiction, in pixels of the table bitmap
 struct  cbuf {              // circular buffer structure
         int     top;        // index of the current element
-        float   x[WLEN];    // array of x coordinates
-        float   y[WLEN];    // array of y coordinates 
+        int     n;          // number of elements, up to WLEN
+        long    seq;        // number of elements stored since the wake was reset
+        short   x[WLEN];    // array of x coordinates
+        short   y[WLEN];    // array of y coordinates 
+};
+struct  cbuf    wake[SIM_MAX_BALLS];  // wake array, stored by the ball task
+struct  cbuf    trail[SIM_MAX_BALLS]; // wake points drawn on the trail layer, owned by the display task
+
+// Rectangle of the table bitmap, corners included; empty when x0 > x1 [pixels]
+struct  drect {
+        int     x0, y0;     // top left corner
+        int     x1, y1;     // bottom right corner
+};
+
+// List of rectangles, merged when they overlap
+struct  rlist {
+        struct  drect   r[MAX_DIRTY];   // rectangles
+        int     n;                      // number of rectangles
+        struct  drect   all;            // bound: rectangles are clipped to it, and replaced by it past MAX_DIRTY
+};
+
+// Drawing command, see CMD_ constants
+struct  dcmd {
+        int     type;       // command type
+        int     x0, y0;     // position, first corner or centre [pixels]
+        int     x1, y1;     // second corner, or radius in x1 [pixels]
+        int     col;        // color
+        int     bg;         // text background color, - 1 = transparent
+        BITMAP* bm;         // sprite
+        char    s[CMD_LEN]; // text
+};
+
+// HUD widget: rendered in its own bitmap and pasted on the frame only when the values it shows change
+struct  widget {
+        BITMAP* bm;         // pre-rendered widget
+        int     x, y;       // top left corner on the frame [pixels]
+        char    key[60];    // shown values the bitmap was rendered for, empty before the first frame
+};
+
+// White ball aim line as drawn on the table bitmap [pixels]
+struct  aim {
+        int     on;         // 1 if the line is shown
+        int     xs, ys;     // first point of the line
+        int     xe, ye;     // last point of the line
+        int     hit;        // 1 if a circle marks what the white ball hits first
+        int     r;          // radius of the circle
+        int     next;       // 1 if a second line shows where the hit ball goes, or where the white ball rebounds
+        int     xa, ya;     // first point of the second line
+        int     xb, yb;     // last point of the second line
 };
-struct  cbuf    wake[N_BALLS];  // wake array
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // GLOBAL VARIABLES
@@ -121,19 +218,73 @@ BITMAP  *CleanTable;        // empty table bitmap to delete past bitmaps
 BITMAP  *Win1;              // player 1 victory message bitmap
 BITMAP  *Win2;              // player 2 victory message bitmap
 
+BITMAP  *Frame;             // frame composed by the display task, the only one drawing on screen
+BITMAP  *TrailLayer;        // trails over the table, transparent elsewhere: points are only added and aged out
+BITMAP  *PathLayer;         // shot preview over the table, transparent elsewhere
+
+unsigned short trail_cnt[YTAB][XTAB];   // wake points drawn on each pixel of the trail layer
+long    n_trail = 0;                    // wake points drawn on the trail layer
+
+// Dirty rectangles: only the parts of the table that changed since the last frame are redrawn
+struct  rlist   dirty = {.all = {0, 0, XTAB - 1, YTAB - 1}};    // table rectangles to redraw in this frame
+struct  rlist   shown = {.all = {0, 0, XWIN - 1, YWIN - 1}};    // frame rectangles to paste on screen
+struct  drect   ball_r[SIM_MAX_BALLS];  // rectangle covered by each ball in the last frame
+struct  aim     aim_prev;               // aim line of the last frame
+long    n_pix = 0;                      // pixels pasted on screen by the last frame
+
+// HUD widgets drawn by the display task
+struct  widget  pow_w;                  // shot power indicator
+struct  widget  par_w;                  // parameters indicators
+struct  widget  player_w;               // whose turn it is and which balls are whose
+struct  widget  trail_w;                // trail display on or off
+
+// Drawing command queue, emptied by the display task at every frame
+struct  dcmd    dq[DQ_LEN];             // queued commands
+int     n_dq = 0;                       // number of queued commands
+int     n_drop = 0;                     // commands dropped because the queue was full
+pthread_mutex_t qmux;                   // queue semaphore
+
+// Frame capture: the display task copies every frame in the ring, the capture task writes them to disk.
+// Single producer and single consumer, so the ring needs no lock; when it is full the frame is dropped
+unsigned char*  cap_buf[CAP_LEN];       // frames in the ring, 32 bit pixels as in the frame
+atomic_ulong    cap_head = 0;           // frames put in the ring by the display task
+atomic_ulong    cap_tail = 0;           // frames written by the capture task
+FILE*   cap_fp = NULL;                  // capture file, NULL when not capturing
+long    cap_drop = 0;                   // frames dropped because the ring was full
+long    cap_seen = 0;                   // frames shown while capturing
+
+// Shot preview: the preview task runs the shot aimed on its own copy of the table, the display task takes the
+// paths found when the lock is free and never waits for them
+int     preview_flag = 0;               // show the shot preview
+struct  sim_state   pv_table;           // table the preview task runs the shot on
+struct  path    pv_res;                 // last preview found
+pthread_mutex_t pmux = PTHREAD_MUTEX_INITIALIZER;   // pv_res semaphore
+struct  path    pv_shown;               // preview drawn on the path layer, owned by the display task
+
 // Semaphores (used for ball structure fields x and y)
 pthread_mutex_t     mux;
 pthread_mutexattr_t matt;
 
+// Exit event, raised by the ESC key
+pthread_mutex_t     quit_mux = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      quit_cond = PTHREAD_COND_INITIALIZER;
+int     quit = 0;           // ESC has been pressed
+
+const char *task_name[N_TASKS] = {"ball", "shot", "display", "set param", "manage", "hud", "capture", "preview"};
+
 // Game parameters
 float   theta = 0;          // shot inclination [rad]
 float   v = V_MAX;          // velocity after the shot [m/s]
-float   f = 0.02 ;          // table friction factor
+float   f = 0.02 ;          // table friction factor (speed lost every SIM_T_REF)
 float   dump = 0.9;         // bounds bouncing dumping factor
 float   T_scale = 1;        // time scale factor
 
+// Stress mode: balls past the first N_BALLS fill a table scaled up to hold them
+int     n_balls = N_BALLS;  // number of balls on the table
+float   cf = CF;            // m to pixels ratio of the drawn table
+
 // Game flags
-int     end = 0;            // task termination flag
+volatile int end = 0;       // task termination flag, polled by the waits for a key too
 int     trail_flag = 0;     // show trail flag
 int     player_flag = 0;    // indicates whose the turn: 0 = player 1, 1 = player 2
 int     phase_flag = 0;     // indicates the phase of the game: 0 = break, 1 = open game, 2 = standard game
@@ -156,6 +307,7 @@ int     nbb = 0;            // counter of bounces on the bounds during the break
 int     nhsol = 0;          // counter of solid balls pocketed
 int     nhstr = 0;          // counter of striped balls pocketed
 int     nf = 0;             // counter of fouls
+int     nsub = 1;           // substeps of the last ball task step
 
 // Conditions
 int     cond1[N_BALLS];     // shot phase activation condition
@@ -177,6 +329,219 @@ int     prev_nf = 0;        // stores nf
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// DIRTY RECTANGLES AND DRAWING COMMANDS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+// Return 1 if the rectangles a and b are equal (all empty rectangles are)
+int     same_rect(const struct drect *a, const struct drect *b)
+{
+        if (a->x0 > a->x1 && b->x0 > b->x1) return 1;
+        return a->x0 == b->x0 && a->y0 == b->y0 && a->x1 == b->x1 && a->y1 == b->y1;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return 1 if the rectangles a and b have a pixel in common
+int     overlap(const struct drect *a, const struct drect *b)
+{
+        return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1 &&
+               a->x0 <= a->x1 && b->x0 <= b->x1;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Add the rectangle r to the list l, merged with one it mostly overlaps; past MAX_DIRTY the list is replaced by
+// its whole bound
+void    add_rect(struct rlist *l, struct drect r)
+{
+int     k;              // rectangle index
+struct drect u;         // union of r and a rectangle of the list
+long    a, b;           // areas of r and of the rectangle of the list [pixels]
+
+        // clip to the bound
+        if (r.x0 < l->all.x0) r.x0 = l->all.x0;
+        if (r.y0 < l->all.y0) r.y0 = l->all.y0;
+        if (r.x1 > l->all.x1) r.x1 = l->all.x1;
+        if (r.y1 > l->all.y1) r.y1 = l->all.y1;
+        if (r.x0 > r.x1 || r.y0 > r.y1) return;
+
+        a = (long) (r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1);
+
+        for (k = 0; k < l->n; k++) {
+
+            if (!overlap(&r, &l->r[k])) continue;
+
+            u.x0 = (r.x0 < l->r[k].x0) ? r.x0 : l->r[k].x0;
+            u.y0 = (r.y0 < l->r[k].y0) ? r.y0 : l->r[k].y0;
+            u.x1 = (r.x1 > l->r[k].x1) ? r.x1 : l->r[k].x1;
+            u.y1 = (r.y1 > l->r[k].y1) ? r.y1 : l->r[k].y1;
+            b = (long) (l->r[k].x1 - l->r[k].x0 + 1) * (l->r[k].y1 - l->r[k].y0 + 1);
+
+            // merge if the union is no larger than the two of them
+            if ((long) (u.x1 - u.x0 + 1) * (u.y1 - u.y0 + 1) <= a + b) {
+                l->r[k] = u;
+                return;
+            }
+        }
+
+        if (l->n == MAX_DIRTY) {
+            l->r[0] = l->all;
+            l->n = 1;
+            return;
+        }
+
+        l->r[l->n++] = r;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Add the rectangle from (x0, y0) to (x1, y1) to the list l
+void    add_area(struct rlist *l, int x0, int y0, int x1, int y1)
+{
+struct drect r;
+
+        r.x0 = (x0 < x1) ? x0 : x1;
+        r.x1 = (x0 < x1) ? x1 : x0;
+        r.y0 = (y0 < y1) ? y0 : y1;
+        r.y1 = (y0 < y1) ? y1 : y0;
+        add_rect(l, r);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Queue a drawing command for the display task; never waits for the drawing, a command is dropped if the
+// queue is full
+void    cmd_push(int type, int x0, int y0, int x1, int y1, int col, int bg, BITMAP* bm, const char* str)
+{
+struct dcmd *c;
+
+        pthread_mutex_lock(&qmux);
+
+        if (n_dq < DQ_LEN) {
+            c = &dq[n_dq++];
+            c->type = type;
+            c->x0 = x0;
+            c->y0 = y0;
+            c->x1 = x1;
+            c->y1 = y1;
+            c->col = col;
+            c->bg = bg;
+            c->bm = bm;
+            c->s[0] = 0;
+            if (str) {
+                strncpy(c->s, str, CMD_LEN - 1);
+                c->s[CMD_LEN - 1] = 0;
+            }
+        }
+        else n_drop++;
+
+        pthread_mutex_unlock(&qmux);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Queue a text, centred on x if centre is set
+void    cmd_text(const char* str, int x, int y, int col, int bg, int centre)
+{
+        cmd_push(centre ? CMD_CENTRE : CMD_TEXT, x, y, 0, 0, col, bg, NULL, str);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Queue a rectangle, a circle (x1 = radius) or a command without arguments
+void    cmd_shape(int type, int x0, int y0, int x1, int y1, int col)
+{
+        cmd_push(type, x0, y0, x1, y1, col, - 1, NULL, NULL);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Queue a sprite with the top left corner in (x, y)
+void    cmd_sprite(BITMAP* bm, int x, int y)
+{
+        cmd_push(CMD_SPRITE, x, y, 0, 0, 0, - 1, bm, NULL);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Execute a drawing command on the frame and mark the area it covered to be pasted on screen
+void    run_cmd(const struct dcmd *c)
+{
+int     len;    // text length [pixels]
+
+        switch (c->type) {
+
+            case CMD_TEXT:
+                textout_ex(Frame, font, c->s, c->x0, c->y0, c->col, c->bg);
+                len = text_length(font, c->s);
+                add_area(&shown, c->x0, c->y0, c->x0 + len, c->y0 + text_height(font));
+                break;
+
+            case CMD_CENTRE:
+                textout_centre_ex(Frame, font, c->s, c->x0, c->y0, c->col, c->bg);
+                len = text_length(font, c->s);
+                add_area(&shown, c->x0 - len/2 - 1, c->y0, c->x0 + len/2 + 1, c->y0 + text_height(font));
+                break;
+
+            case CMD_RECT:
+                rect(Frame, c->x0, c->y0, c->x1, c->y1, c->col);
+                add_area(&shown, c->x0, c->y0, c->x1, c->y1);
+                break;
+
+            case CMD_FILL:
+                rectfill(Frame, c->x0, c->y0, c->x1, c->y1, c->col);
+                add_area(&shown, c->x0, c->y0, c->x1, c->y1);
+                break;
+
+            case CMD_CIRCLE:
+                circle(Frame, c->x0, c->y0, c->x1, c->col);
+                add_area(&shown, c->x0 - c->x1, c->y0 - c->x1, c->x0 + c->x1, c->y0 + c->x1);
+                break;
+
+            case CMD_DISC:
+                circlefill(Frame, c->x0, c->y0, c->x1, c->col);
+                add_area(&shown, c->x0 - c->x1, c->y0 - c->x1, c->x0 + c->x1, c->y0 + c->x1);
+                break;
+
+            case CMD_SPRITE:
+                draw_sprite(Frame, c->bm, c->x0, c->y0);
+                add_area(&shown, c->x0, c->y0, c->x0 + c->bm->w - 1, c->y0 + c->bm->h - 1);
+                break;
+
+            case CMD_HIDE: scare_mouse(); break;
+
+            case CMD_SHOW: unscare_mouse(); break;
+
+            default: break;
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Create the widget covering the frame from (x0, y0) to (x1, y1)
+void    init_widget(struct widget *w, int x0, int y0, int x1, int y1)
+{
+        w->bm = create_bitmap(x1 - x0 + 1, y1 - y0 + 1);
+        w->x = x0;
+        w->y = y0;
+        w->key[0] = 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return 1 if the widget shows other values than key, which it is going to be rendered for
+int     widget_changed(struct widget *w, const char* key)
+{
+        if (strcmp(w->key, key) == 0) return 0;
+
+        strncpy(w->key, key, sizeof(w->key) - 1);
+        w->key[sizeof(w->key) - 1] = 0;
+        return 1;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Paste the widget on the frame
+void    paste_widget(const struct widget *w)
+{
+        blit(w->bm, Frame, 0, 0, w->x, w->y, w->bm->w, w->bm->h);
+        add_area(&shown, w->x, w->y, w->x + w->bm->w - 1, w->y + w->bm->h - 1);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// GAME FUNCTIONS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
 // Return the pressed key
 char    get_scancode()
 {
@@ -184,6 +549,18 @@ char    get_scancode()
     else return 0;
 }
 
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Keyboard event handler, called by Allegro for every key pressed or released: ESC raises the exit event
+void    key_event(int scancode)
+{
+        if (scancode != KEY_ESC) return; // releases have the high bit set
+
+        pthread_mutex_lock(&quit_mux);
+        quit = 1;
+        pthread_cond_signal(&quit_cond);
+        pthread_mutex_unlock(&quit_mux);
+}
+
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // Returns ball type
 int     get_type(void) 
@@ -192,156 +569,231 @@ int     i;  // ball index
 int     type = - 1;
 
         for (i = 0; i < N_BALLS; i++) {
-            if (!ball[i].active_flag && ball[i].el_ph == 1) type = ball[i].type;
+            if (!table.active[i] && ball[i].el_ph == 1) type = ball[i].type;
         }
 
         return type;
 }
 
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Scatter the balls past the first N_BALLS on a jittered hexagonal lattice covering the field,
+// keeping clear of the racked balls; returns the number of balls on the table
+int     place_extra_balls(void)
+{
+int     i, j;                   // ball indexes
+int     row;                    // lattice row
+int     clear;                  // 1 if the lattice point is far from the racked balls
+float   d = STRESS_SP * DIAM;   // lattice spacing [m]
+float   x, y;                   // lattice point [m]
+float   xb, yb;                 // ball position [m]
+
+        i = N_BALLS;
+
+        for (row = 0, y = DIAM; y < table.table.ly - DIAM && i < n_balls; row++, y += d * sqrt(3)/2) {
+            for (x = DIAM + (row % 2) * d/2; x < table.table.lx - DIAM && i < n_balls; x += d) {
+
+                // the jitter keeps neighbours more than a diameter apart
+                xb = x + (DIAM/20) * (2 * (float) rand() / RAND_MAX - 1);
+                yb = y + (DIAM/20) * (2 * (float) rand() / RAND_MAX - 1);
+
+                clear = 1;
+                for (j = 0; j < N_BALLS; j++) {
+                    if (hypot(xb - table.x[j], yb - table.y[j]) < 2 * DIAM) clear = 0;
+                }
+
+                if (clear) sim_place(&table, i++, xb, yb);
+            }
+        }
+
+        return i;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return a copy of the sprite scaled to the ball size on the drawn table
+BITMAP* scale_sprite(BITMAP* bm)
+{
+BITMAP* sc;     // scaled sprite
+int     d;      // ball diameter [pixels]
+
+        d = (int) (cf * DIAM + 0.5);
+        sc = create_bitmap(d, d);
+        stretch_blit(bm, sc, 0, 0, bm->w, bm->h, 0, 0, d, d);
+
+        return sc;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Load the table and the ball bitmaps once, packed in the atlas (converted to the screen pixel format)
+void    load_art(void)
+{
+int     i;          // ball index
+int     x;          // x coord. of the next ball in the atlas [pixels]
+int     w, h;       // atlas size [pixels]
+char    name[20];   // bitmap file name
+BITMAP* tab;        // table bitmap as loaded
+BITMAP* bm[N_BALLS];// ball bitmaps as loaded
+
+        tab = load_bitmap("table.bmp", NULL);
+        w = tab->w;
+        h = 0;
+        for (i = 0, x = 0; i < N_BALLS; i++) {
+            sprintf(name, "ball%d.bmp", i);
+            bm[i] = load_bitmap(name, NULL);
+            x += bm[i]->w;
+            if (bm[i]->h > h) h = bm[i]->h;
+        }
+        if (x > w) w = x;
+
+        art.atlas = create_bitmap(w, tab->h + h);
+        clear_to_color(art.atlas, bitmap_mask_color(art.atlas));
+        blit(tab, art.atlas, 0, 0, 0, 0, tab->w, tab->h);
+
+        CleanTable = create_sub_bitmap(art.atlas, 0, 0, tab->w, tab->h);
+        GameTable = create_bitmap(tab->w, tab->h);
+        blit(tab, GameTable, 0, 0, 0, 0, tab->w, tab->h);
+        destroy_bitmap(tab);
+
+        for (i = 0, x = 0; i < N_BALLS; i++) {
+            blit(bm[i], art.atlas, 0, 0, x, CleanTable->h, bm[i]->w, bm[i]->h);
+            art.cell[i] = create_sub_bitmap(art.atlas, x, CleanTable->h, bm[i]->w, bm[i]->h);
+            x += bm[i]->w;
+            destroy_bitmap(bm[i]);
+        }
+
+        art.k = 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Free the ball sprites made for the last table scale factor
+void    free_ball_sprites(void)
+{
+int     i;  // ball index
+
+        for (i = 0; i < N_BALLS; i++) {
+            if (art.rle[i]) destroy_rle_sprite(art.rle[i]);
+            if (art.bm[i] && art.bm[i] != art.cell[i]) destroy_bitmap(art.bm[i]);
+            art.rle[i] = NULL;
+            art.bm[i] = NULL;
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Give balls 0 to 15 their sprites for the table scale factor k, made from the atlas unless they have already
+// been made for it
+void    set_ball_sprites(float k)
+{
+int     i;  // ball index
+
+        if (k != art.k) {
+            free_ball_sprites();
+            for (i = 0; i < N_BALLS; i++) {
+                art.bm[i] = (k > 1) ? scale_sprite(art.cell[i]) : art.cell[i];
+                art.rle[i] = get_rle_sprite(art.bm[i]);
+            }
+            art.k = k;
+        }
+
+        for (i = 0; i < N_BALLS; i++) {
+            ball[i].bm = art.bm[i];
+            ball[i].rle = art.rle[i];
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Stress mode: grow the table (holes included, so it still matches the table bitmap) until
+// the extra balls fit, scale the sprites and let the extra balls share those of balls 1 to 15
+void    init_extra_balls(void)
+{
+int     i;          // ball index
+float   k = 1;      // table scale factor
+
+        while (1) {
+            sim_set_table(&table, k * LX, k * LY, k * HC, k * HP);
+            sim_rack(&table);
+            if (place_extra_balls() == n_balls) break;
+            k *= 1.1;
+        }
+
+        cf = CF / k;
+
+        set_ball_sprites(k);
+
+        for (i = N_BALLS; i < n_balls; i++) {
+            ball[i].tcol = ball[1 + (i - N_BALLS) % 15].tcol;
+            ball[i].bm = ball[1 + (i - N_BALLS) % 15].bm;
+            ball[i].rle = ball[1 + (i - N_BALLS) % 15].rle;
+            ball[i].type = - 1;
+            ball[i].el_ph = - 1;
+        }
+}
+
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // Initialize balls status structure with defining parameters
 void    init_balls(void)
 {
 int     i;          // ball index
-float   a, r, f;    // these parameters define the relative position of the balls
 
-        f = 1.1;    // defines the distance among balls keeping the formation
-        a = f * sqrt(3) * DIAM/2;
-        r = f * DIAM/2;
+        // Break formation, spawn and parking positions
+        sim_rack(&table);
 
         // White ball
-        ball[0].x = B0SX;
-        ball[0].y = B0SY;
         ball[0].tcol = WHITE;
-        ball[0].bm = load_bitmap("ball0.bmp", NULL);
 
         // Ball 1
-        ball[1].x = B1SX;
-        ball[1].y = B1SY;
         ball[1].tcol = YELLOW;
-        ball[1].bm = load_bitmap("ball1.bmp", NULL);
-        ball[1].xo = B1EX;
-        ball[1].yo = B1EY;
 
         // Ball 2
-        ball[2].x = B1SX + a;
-        ball[2].y = B1SY + r;
         ball[2].tcol = BLUE;
-        ball[2].bm = load_bitmap("ball2.bmp", NULL);
-        ball[2].xo = B1EX;
-        ball[2].yo = B1EY + 2*DIAM;
 
         // Ball 3
-        ball[3].x = B1SX + 2*a;
-        ball[3].y = B1SY + 2*r;
         ball[3].tcol = RED;
-        ball[3].bm = load_bitmap("ball3.bmp", NULL);
-        ball[3].xo = B1EX;
-        ball[3].yo = B1EY + 4*DIAM;
 
         // Ball 4
-        ball[4].x = B1SX + 3*a;
-        ball[4].y = B1SY + 3*r;
         ball[4].tcol = PURPLE;
-        ball[4].bm = load_bitmap("ball4.bmp", NULL);
-        ball[4].xo = B1EX;
-        ball[4].yo = B1EY + 6*DIAM;
 
         // Ball 5
-        ball[5].x = B1SX + 4*a;
-        ball[5].y = B1SY - 4*r;
         ball[5].tcol = ORANGE;
-        ball[5].bm = load_bitmap("ball5.bmp", NULL);
-        ball[5].xo = B1EX;
-        ball[5].yo = B1EY + 8*DIAM;
 
         // Ball 6
-        ball[6].x = B1SX + 4*a;
-        ball[6].y = B1SY;
         ball[6].tcol = GREEN;
-        ball[6].bm = load_bitmap("ball6.bmp", NULL);
-        ball[6].xo = B1EX;
-        ball[6].yo = B1EY + 10*DIAM;
 
         // Ball 7
-        ball[7].x = B1SX + 3*a;
-        ball[7].y = B1SY - r;
         ball[7].tcol = BROWN;
-        ball[7].bm = load_bitmap("ball7.bmp", NULL);
-        ball[7].xo = B1EX;
-        ball[7].yo = B1EY + 12*DIAM;
 
         // Ball 8
-        ball[8].x = B1SX + 2*a;
-        ball[8].y = B1SY;
         ball[8].tcol = BLACK;
-        ball[8].bm = load_bitmap("ball8.bmp", NULL);
-        ball[8].xo = B1EX;
-        ball[8].yo = B1EY + 14*DIAM;
 
         // Ball 9
-        ball[9].x = B1SX + a;
-        ball[9].y = B1SY - r;
         ball[9].tcol = YELLOW;
-        ball[9].bm = load_bitmap("ball9.bmp", NULL);
-        ball[9].xo = B1EX + 2*DIAM;
-        ball[9].yo = B1EY;
 
         // Ball 10
-        ball[10].x = B1SX + 2*a;
-        ball[10].y = B1SY - 2*r;
         ball[10].tcol = BLUE;
-        ball[10].bm = load_bitmap("ball10.bmp", NULL);
-        ball[10].xo = B1EX + 2*DIAM;
-        ball[10].yo = B1EY + 2*DIAM;
 
         // Ball 11
-        ball[11].x = B1SX + 3*a;
-        ball[11].y = B1SY - 3*r;
         ball[11].tcol = RED;
-        ball[11].bm = load_bitmap("ball11.bmp", NULL);
-        ball[11].xo = B1EX + 2*DIAM;
-        ball[11].yo = B1EY + 4*DIAM;
 
         // Ball 12
-        ball[12].x = B1SX + 4*a;
-        ball[12].y = B1SY + 4*r;
         ball[12].tcol = PURPLE;
-        ball[12].bm = load_bitmap("ball12.bmp", NULL);
-        ball[12].xo = B1EX + 2*DIAM;
-        ball[12].yo = B1EY + 6*DIAM;
 
         // Ball 13
-        ball[13].x = B1SX + 4*a;
-        ball[13].y = B1SY - 2*r;
         ball[13].tcol = ORANGE;
-        ball[13].bm = load_bitmap("ball13.bmp", NULL);
-        ball[13].xo = B1EX + 2*DIAM;
-        ball[13].yo = B1EY + 8*DIAM;
 
         // Ball 14
-        ball[14].x = B1SX + 3*a;
-        ball[14].y = B1SY + r;
         ball[14].tcol = GREEN;
-        ball[14].bm = load_bitmap("ball14.bmp", NULL);
-        ball[14].xo = B1EX + 2*DIAM;
-        ball[14].yo = B1EY + 10*DIAM;
 
         // Ball 15
-        ball[15].x = B1SX + 4*a;
-        ball[15].y = B1SY + 2*r;
         ball[15].tcol = BROWN;
-        ball[15].bm = load_bitmap("ball15.bmp", NULL);
-        ball[15].xo = B1EX + 2*DIAM;  
-        ball[15].yo = B1EY + 12*DIAM;
 
-        // All balls start still and active
-        for (i = 0; i < N_BALLS; i++) {
-            ball[i].vx = 0;
-            ball[i].vy = 0;
-            ball[i].active_flag = 1;
-            wake[i].top = 0; // initialize wake
-            
+        // Sprites from the atlas, no file is loaded again on a restart.
+        // Stress mode: fill the table with the extra balls, with sprites scaled to the grown table
+        if (n_balls > N_BALLS) init_extra_balls();
+        else                   set_ball_sprites(1);
+
+        // Initialize wakes
+        for (i = 0; i < n_balls; i++) {
+            wake[i].top = 0;
+            wake[i].n = 0;
+            wake[i].seq = 0;
         }
 
         // Balls from 1 to 7 are solid
@@ -357,341 +809,194 @@ float   a, r, f;    // these parameters define the relative position of the ball
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Initialize holes position
-void    init_holes(void)
+// Publish the ball positions reached after a step of dt, over the older of the last two states (mux held)
+void    snap_publish(float dt)
 {
-    // upper left hole
-    hole[0].x = - HC;
-    hole[0].y = - HC;
-
-    // upper middle hole
-    hole[1].x = LX/2;
-    hole[1].y = - HC;
-
-    // upper right hole
-    hole[2].x = LX + HC;
-    hole[2].y = - HC;
-
-    // lower right hole
-    hole[3].x = LX + HC;
-    hole[3].y = LY + HC;
-
-    // lower middle hole
-    hole[4].x = LX/2;
-    hole[4].y = LY + HC;
-
-    // lower left hole
-    hole[5].x = - HC;
-    hole[5].y = LY + HC;
+struct snap *sn;    // state published
+
+        snap_last ^= 1;
+        sn = &snap[snap_last];
+        sn->t = get_systime(MICRO);
+        sn->dt = dt;
+        memcpy(sn->x, table.x, table.n * sizeof(float));
+        memcpy(sn->y, table.y, table.n * sizeof(float));
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Initialize game environment, Allegro settings and scheduling policy
-void    init(void) 
+// Ball positions at time now [us], interpolated between the last two published states, so that the display
+// runs one ball task period behind the physics; a ball moving faster than a shot (pocketed, placed again) is shown
+// where it is now
+void    snap_positions(long now, float x[], float y[])
 {
-        allegro_init();
-
-        install_keyboard();
-
-        install_mouse();
-        
-        set_color_depth(32);
-
-        if (set_gfx_mode(GFX_AUTODETECT_WINDOWED, XWIN, YWIN, 0, 0) != 0) {
-            allegro_message("Failed to initialize graphics mode!\n");
-            exit(-1);
+int     i;          // ball index
+float   w;          // weight of the newest state
+float   jump;       // longest move of a ball in a step [m]
+float   dx, dy;     // move of a ball in the last step [m]
+struct snap *a, *b; // older and newest state
+
+        pthread_mutex_lock(&mux);
+
+        a = &snap[snap_last ^ 1];
+        b = &snap[snap_last];
+
+        w = 1;
+        if (b->t > a->t && now - b->t < b->t - a->t) w = (float) (now - b->t) / (b->t - a->t);
+        if (w < 0) w = 0;
+        jump = V_MAX * b->dt;
+
+        for (i = 0; i < table.n; i++) {
+            dx = b->x[i] - a->x[i];
+            dy = b->y[i] - a->y[i];
+            if (fabs(dx) > jump || fabs(dy) > jump) {
+                x[i] = b->x[i];
+                y[i] = b->y[i];
+            }
+            else {
+                x[i] = a->x[i] + w * dx;
+                y[i] = a->y[i] + w * dy;
+            }
         }
 
-        clear_to_color(screen, DARK_BLUE);
-
-        show_mouse(screen);
-
-        GameTable = load_bitmap("table.bmp", NULL);
-        CleanTable = load_bitmap("table.bmp", NULL);
-
-        Win1 = load_bitmap("P1W.bmp", NULL);
-        Win2 = load_bitmap("P2W.bmp", NULL);
-
-        draw_sprite(screen, GameTable, x_tc, y_tc);
-
-        init_balls();
-
-        init_holes();
-
-        ptask_init(SCHED_FIFO);
-    }
-
-/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Update i-th ball status
-void    update_status(int i, float f, float dt)
-{  
-        // Euler integration for position-velocity
-        ball[i].x += ball[i].vx * dt;
-        ball[i].y += ball[i].vy * dt;
-
-        // Apply friction factor (NOTE: dependent on integration step but not directly)
-        ball[i].vx *= (1 - f); 
-        ball[i].vy *= (1 - f);
+        pthread_mutex_unlock(&mux);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Handle bounces of i-th ball on the table borders considering the dumping factor
-void    handle_bounce(int i, float dump)
+// Initialize game environment, Allegro settings and scheduling policy; without a window (headless benchmark)
+// everything is drawn in memory bitmaps and no input device nor task is used
+void    init(int window) 
 {
-float   vx, vy;             // temporary velocity data copy
-float   RAD = DIAM / 2;     // ball radius
-
-        // bounce on left border
-        if ((ball[i].x < RAD) && ((ball[i].y > HP - RAD) && (ball[i].y < LY - HP + RAD))) { // bound check
-
-            ball[i].x = RAD;
-            ball[i].vx = - dump * ball[i].vx;
-
-            if (phase_flag == 0) nbb++; // count the bounce on the bounds to check if the break has to be repeated
+        if (!window) {
+            install_allegro(SYSTEM_NONE, &errno, atexit);
+            set_color_depth(32);
         }
+        else {
+            allegro_init();
 
-        // bounce on right border
-        if ((ball[i].x > LX - RAD) && ((ball[i].y > HP - RAD) && (ball[i].y < LY - HP + RAD))) { 
-
-            ball[i].x = LX - RAD;
-            ball[i].vx = - dump * ball[i].vx;
-
-            if (phase_flag == 0) nbb++;
-        }
+            install_keyboard();
+            keyboard_lowlevel_callback = key_event;
 
-        // bounce on upper border
-        if ((ball[i].y < RAD) && (((ball[i].x > HP - RAD) && (ball[i].x < LX/2 - HP + RAD)) || ((ball[i].x > LX/2 + HP - RAD) && (ball[i].x < LX - HP + RAD)))) {
+            install_mouse();
+            
+            set_color_depth(32);
 
-            ball[i].y = RAD;
-            ball[i].vy = - dump * ball[i].vy;
+            if (set_gfx_mode(GFX_AUTODETECT_WINDOWED, XWIN, YWIN, 0, 0) != 0) {
+                allegro_message("Failed to initialize graphics mode!\n");
+                exit(-1);
+            }
 
-            if (phase_flag == 0) nbb++;
+            show_mouse(screen);
         }
 
-        // bounce on lower border
-        if ((ball[i].y > LY - RAD) && (((ball[i].x > HP - RAD) && (ball[i].x < LX/2 - HP + RAD)) || ((ball[i].x > LX/2 + HP - RAD) && (ball[i].x < LX - HP + RAD)))) {
+        // The display task composes every frame here and pastes it on screen
+        Frame = create_bitmap(XWIN, YWIN);
+        clear_to_color(Frame, DARK_BLUE);
+        TrailLayer = create_bitmap(XTAB, YTAB);
+        clear_to_color(TrailLayer, bitmap_mask_color(TrailLayer));
+        PathLayer = create_bitmap(XTAB, YTAB);
+        clear_to_color(PathLayer, bitmap_mask_color(PathLayer));
+        pthread_mutex_init(&qmux, NULL);
 
-            ball[i].y = LY - RAD;
-            ball[i].vy = - dump * ball[i].vy;
-
-            if (phase_flag == 0) nbb++;
-        }
+        load_art();
 
-        // For each of the corner holes there is a short tunnel that leads to the hole
-
-        // bounce inside left-upper corner
-        // right wall of the tunnel (ball perspective)
-        if ((ball[i].y < RAD) && (ball[i].x < HP) && (ball[i].x > ball[i].y + HP - RAD)) {
-            vx = dump * ball[i].vy;
-            vy = dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        Win1 = load_bitmap("P1W.bmp", NULL);
+        Win2 = load_bitmap("P2W.bmp", NULL);
 
-        // left wall of the tunnel (ball perspective)
-        if ((ball[i].x < RAD) && (ball[i].y < HP) && (ball[i].x < ball[i].y - HP + RAD)) {
-            vx = dump * ball[i].vy;
-            vy = dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        // HUD widgets, with the areas they cover on the frame
+        init_widget(&pow_w, 0, 483 - IN_HEI - 25, 111, 490);
+        init_widget(&par_w, 19, 600 + 13, 20 + 200 + 1, (712 + 8 + 30 + 1) + 10);
+        init_widget(&player_w, 10, 519, x_tc - 10, 520 + 41);
+        init_widget(&trail_w, 5, 580, x_tc - 5, 580 + 20);
 
-        // bounce inside left-lower corner
-        // right wall of the tunnel (ball perspective)
-        if ((ball[i].x < RAD) && (ball[i].y > LY - HP) && (ball[i].x < - ball[i].y + LY - HP + RAD)) {
-            vx = - dump * ball[i].vy;
-            vy = - dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        sim_init(&table, n_balls, f, dump);
+        table.solver = 1;   // solve the contacts of the break all together
 
-        // left wall of the tunnel (ball perspective)
-        if ((ball[i].y > LX - RAD) && (ball[i].x < HP) && (ball[i].x > - ball[i].y + LY + HP - RAD)) {
-            vx = - dump * ball[i].vy;
-            vy = - dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        init_balls();
+        snap_publish(0);    // both states, until the first step
+        snap_publish(0);
 
-        // bounce inside right-upper corner
-        // right wall of the tunnel (ball perspective)
-        if ((ball[i].x > LX - RAD) && (ball[i].y < HP) && (ball[i].x > - ball[i].y + LX + HP - RAD)) {
-            vx = - dump * ball[i].vy;
-            vy = - dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        pv_table = table;       // the preview task places the balls on its copy before each run
+        pv_table.pool.n = 1;    // the workers of the table belong to it
 
-        // left wall of the tunnel (ball perspective)
-        if ((ball[i].y < RAD) && (ball[i].x > LX - HP) && (ball[i].x < - ball[i].y + LX - HP + RAD)) {
-            vx = - dump * ball[i].vy;
-            vy = - dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        if (window) ptask_init(SCHED_FIFO);
+    }
 
-        // bounce inside right-lower corner
-        // right wall of the tunnel (ball perspective)
-        if ((ball[i].y > LY - RAD) && (ball[i].x > LX - HP) && (ball[i].x < ball[i].y + LX - LY - HP + RAD)) {
-            vx = dump * ball[i].vy;
-            vy = dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Free the bitmaps and close Allegro
+void    close_game(void)
+{
+int     i;  // ball index
 
-        // left wall of the tunnel (ball perspective)
-        if ((ball[i].x > LX - RAD) && (ball[i].y > LY - HP) && (ball[i].x > ball[i].y + LX -LY + HP - RAD)) {
-            vx = dump * ball[i].vy;
-            vy = dump * ball[i].vx;
-            ball[i].vx = vx;
-            ball[i].vy = vy;
-        }
+        destroy_bitmap(GameTable);
+        destroy_bitmap(Frame);
+        destroy_bitmap(TrailLayer);
+        destroy_bitmap(PathLayer);
+        free_ball_sprites();
+        for (i = 0; i < N_BALLS; i++) destroy_bitmap(art.cell[i]);
+        destroy_bitmap(CleanTable);
+        destroy_bitmap(art.atlas);
+        allegro_exit();
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Handle all the cases of each ball being pocketed
+// Apply the game rules to the balls pocketed during the last physics step
 void    handle_holes(void)
 {
+int     k;          // pocketing event index
 int     i, j;       // ball and hole indexes
-float   d[N_HOLES]; // every element is the distance from each hole
-
-        for (i = 0; i < N_BALLS; i++) {
-            for (j = 0; j < N_HOLES; j++) {
-
-                // Compute the distance between each ball centre and each hole centre
-                d[j] = sqrt((ball[i].x - hole[j].x)*(ball[i].x - hole[j].x) + (ball[i].y - hole[j].y)*(ball[i].y - hole[j].y));
 
-                if (d[j] < HP) { // if a ball ends up in a hole
+        for (k = 0; k < table.npocket; k++) {
 
-                    // Increases counter of eliminated solid and striped balls
-                    if (!ball[i].type && i != 0 && i != 8) nhsol++;
-                    if (ball[i].type && i != 0 && i != 8)  nhstr++;
-                    
-                    // white ball pocketed
-                    if (i == 0) {
-                        // if the white ball is pocketed after the 8, the other player wins
-                        if (!ball[8].active_flag) { 
-                            if (!player_flag) win_flag = 2;
-                            if (player_flag) win_flag = 1;
-                        }
-                        // In other cases it's a foul
-                        else {
-                            ball[0].active_flag = 0;
-                            nf++;
-                        }
-                    }
-                    // 8 ball pocketed: it causes the win of the other player in all cases but the one in which the winning shot belongs to one of the players
-                    else if (i == 8) {
-                        ball[8].active_flag = 0;
-                        ball[8].x = ball[i].xo;
-                        ball[8].y = ball[i].yo;
-                        if (!player_flag && !en81_flag) win_flag = 2;   // if during player 1 turn the ball is pocketed but it's not due, player 2 wins
-                        if (player_flag && !en82_flag) win_flag = 1;    // if during player 2 turn the ball is pocketed but it's not due, player 1 wins
-                        if (!player_flag && en81_flag) {                // if during player 1 turn the ball is pocketed and it's a winning shot
-                            if (j == dec_hole) win_flag = 1;  // if it's pocketed in the declared hole player 1 wins
-                            else               win_flag = 2;  // otherwise player 2 wins
-                        }
-                        if (player_flag && en82_flag) {                 // if during player 2 turn the ball is pocketed and it's a winning shot
-                            if (j == dec_hole) win_flag = 2;  // if it's pocketed in the declared hole player 2 wins
-                            else               win_flag = 1;  // otherwise player 1 wins
-                        }
-                    }
-                    // in other cases the ball is deactivated and put outside the field
-                    else {
-                        ball[i].active_flag = 0;
-                        ball[i].x = ball[i].xo;
-                        ball[i].y = ball[i].yo;
-                        ball[i].el_ph = phase_flag; // this is useful for type assignment
-                    }                    
-                }
-            }
-        }   
-}
-
-/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Handle collisions between balls and update counters of collisions between certain balls
-void    handle_collision(int i, int j, float dump)
-{
-float   xi, yi;             // coordinates of i-th ball position
-float   xj, yj;             // coordinates of j-th ball position
-float   vxi, vyi;           // velocity of i-th ball before collision
-float   vxj, vyj;           // velocity of j-th ball before collision
-float   d;                  // distance between balls
-float   e;                  // ball intersection
-float   nx, ny;             // normal versor components
-float   tx, ty;             // tangent versor components
-float   vni, vti;           // velocity module on normal and tangential direction of i-th ball before collision 
-float   vnj, vtj;           // velocity module on normal and tangential direction of j-th ball before collision 
-float   vni_new, vnj_new;   // normal velocities after collision
-float   A;                  // this element prevents to do a square root of a negative number
+            i = table.pocket[k].ball;
+            j = table.pocket[k].hole;
 
-        xi = ball[i].x;
-        yi = ball[i].y;
+            if (i >= N_BALLS) continue; // the extra balls of the stress mode take no part in the game
 
-        xj = ball[j].x;
-        yj = ball[j].y;
+            // Increases counter of eliminated solid and striped balls
+            if (!ball[i].type && i != 0 && i != 8) nhsol++;
+            if (ball[i].type && i != 0 && i != 8)  nhstr++;
 
-        d = sqrt((xi - xj)*(xi - xj) + (yi - yj)*(yi - yj));
-
-        if (d < DIAM) {
-            
-            // the counters increase just with the first bump, after that the counter is disabled
-            if (fb_flag) {
-                if (i == 0 && !ball[j].type && j != 8) {
-                    n0sol++; // white touches solid
-                    fb_flag = 0;
+            // white ball pocketed
+            if (i == 0) {
+                // if the white ball is pocketed after the 8, the other player wins
+                if (!table.active[8]) {
+                    if (!player_flag) win_flag = 2;
+                    if (player_flag) win_flag = 1;
                 }
-                if (i == 0 && ball[j].type && j != 8) {
-                    n0str++; // white touches striped
-                    fb_flag = 0;
+                // In other cases it's a foul
+                else nf++;
+            }
+            // 8 ball pocketed: it causes the win of the other player in all cases but the one in which the winning shot belongs to one of the players
+            else if (i == 8) {
+                if (!player_flag && !en81_flag) win_flag = 2;   // if during player 1 turn the ball is pocketed but it's not due, player 2 wins
+                if (player_flag && !en82_flag) win_flag = 1;    // if during player 2 turn the ball is pocketed but it's not due, player 1 wins
+                if (!player_flag && en81_flag) {                // if during player 1 turn the ball is pocketed and it's a winning shot
+                    if (j == dec_hole) win_flag = 1;  // if it's pocketed in the declared hole player 1 wins
+                    else               win_flag = 2;  // otherwise player 2 wins
                 }
-                if (i == 0 && j == 8) {
-                    n08++; // white touches 8
-                    fb_flag = 0;
+                if (player_flag && en82_flag) {                 // if during player 2 turn the ball is pocketed and it's a winning shot
+                    if (j == dec_hole) win_flag = 2;  // if it's pocketed in the declared hole player 2 wins
+                    else               win_flag = 1;  // otherwise player 1 wins
                 }
             }
-            // versors definition
-            nx = (xi - xj) / d;
-            ny = (yi - yj) / d;
-
-            tx = - ny;
-            ty = nx;
-
-            e = DIAM - d;
-
-            // Solve compenetration
-            ball[i].x += (e/2) * nx;
-            ball[i].y += (e/2) * ny;
-
-            ball[j].x -= (e/2) * nx;
-            ball[j].y -= (e/2) * ny;
-
-            // Solve partially anelastic collision
-            vxi = ball[i].vx;
-            vyi = ball[i].vy;
-
-            vxj = ball[j].vx;
-            vyj = ball[j].vy;
-
-            vni = vxi * nx + vyi * ny;
-            vnj = vxj * nx + vyj * ny;
-
-            vti = vxi * tx + vyi * ty;
-            vtj = vxj * tx + vyj * ty;
-
-            if ((2*dump*dump - 1)*(vni*vni + vnj*vnj) - 2*vni*vnj > 0) {
-                A = 0.5*sqrt((2*dump*dump - 1)*(vni*vni + vnj*vnj) - 2*vni*vnj);
-            }
-            else A = 0;
+            // in other cases the ball has been put outside the field by the physics
+            else ball[i].el_ph = phase_flag; // this is useful for type assignment
+        }
+}
 
-            vni_new = 0.5*(vni + vnj) + A;
-            vnj_new = 0.5*(vni + vnj) - A;
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Update counters of collisions between the white ball and the first ball it touched
+void    handle_collision(void)
+{
+int     j;  // index of the first ball touched by the white ball
 
-            ball[i].vx = vni_new * nx + vti * tx;
-            ball[i].vy = vni_new * ny + vti * ty;
+        j = table.first_hit;
 
-            ball[j].vx = vnj_new * nx + vtj * tx;
-            ball[j].vy = vnj_new * ny + vtj * ty;
+        // the counters increase just with the first bump, after that the counter is disabled
+        if (fb_flag && j > 0 && j < N_BALLS) {
+            if (!ball[j].type && j != 8) n0sol++;   // white touches solid
+            if (ball[j].type && j != 8)  n0str++;   // white touches striped
+            if (j == 8)                  n08++;     // white touches 8
+            fb_flag = 0;
         }
 }
 
@@ -700,30 +1005,43 @@ float   A;                  // this element prevents to do a square root of a ne
 void    foul(void)
 {
 float   x_m, y_m;    // mouse position in the field
+int     mx = - 1, my = - 1; // mouse position of the last circle drawn [pixels]
+int     rad = cf * DIAM/2;  // circle radius [pixels]
 
         foul_flag = 1;
 
-        if (ball[0].active_flag) ball[0].active_flag  = 0; // deactivate white ball
+        pthread_mutex_lock(&mux);
+        if (table.active[0]) sim_park(&table, 0); // deactivate white ball
+        pthread_mutex_unlock(&mux);
 
         if (player_flag) player_flag = 0;
         else             player_flag = 1;
 
         do { // move the mouse to choose the position
 
-            x_m = (((float) mouse_x - x_or) / CF);
-            y_m = (((float) mouse_y - y_or) / CF);
+            x_m = (((float) mouse_x - x_or) / cf);
+            y_m = (((float) mouse_y - y_or) / cf);
 
-            if (mouse_x > x_tc + BANK && mouse_x < x_tc + XTAB  - BANK && mouse_y > y_tc + BANK && mouse_y < y_tc + YTAB - BANK)
-                circle(screen, mouse_x, mouse_y, DIAM_P/2, RED);
+            // the circle follows the mouse, only the table under the one before is redrawn
+            if (mouse_x > x_tc + BANK && mouse_x < x_tc + XTAB  - BANK && mouse_y > y_tc + BANK && mouse_y < y_tc + YTAB - BANK &&
+                (mouse_x != mx || mouse_y != my)) {
+                if (mx >= 0) cmd_shape(CMD_ERASE, mx - rad, my - rad, mx + rad, my + rad, 0);
+                mx = mouse_x;
+                my = mouse_y;
+                cmd_shape(CMD_CIRCLE, mx, my, rad, 0, RED);
+            }
 
-            if (x_m > 0 && x_m < LX) ball[0].x = x_m;
-            if (y_m > 0 && y_m < LY) ball[0].y = y_m;
+            pthread_mutex_lock(&mux);
+            if (x_m > 0 && x_m < table.table.lx) table.x[0] = x_m;
+            if (y_m > 0 && y_m < table.table.ly) table.y[0] = y_m;
+            pthread_mutex_unlock(&mux);
 
-        } while (!key[KEY_TAB]); // press TAB to confirm the position
+        } while (!key[KEY_TAB] && !end); // press TAB to confirm the position
 
-        ball[0].active_flag = 1; // reactivate the ball and put velocities to 0
-        ball[0].vx = 0;
-        ball[0].vy = 0;
+        if (mx >= 0) cmd_shape(CMD_ERASE, mx - rad, my - rad, mx + rad, my + rad, 0); // erase the last circle
+        pthread_mutex_lock(&mux);
+        sim_place(&table, 0, table.x[0], table.y[0]); // reactivate the ball still
+        pthread_mutex_unlock(&mux);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
@@ -732,18 +1050,18 @@ void    endgame(void)
 {
 int     i;  // ball index
 
-        do {
-            if (win_flag == 1) draw_sprite(screen, Win1, x_tc, y_tc);
-            if (win_flag == 2) draw_sprite(screen, Win2, x_tc, y_tc);
-        } while (!key[KEY_ENTER]);
-
-        // In case of restart 
-        rectfill(screen, x_tc, y_tc, x_tc + XTAB, y_tc + YTAB, DARK_BLUE);
-        rectfill(screen, x_tc + XTAB + 1, y_tc, XWIN, y_tc + YTAB, DARK_BLUE);
+        if (win_flag == 1) cmd_sprite(Win1, x_tc, y_tc);
+        if (win_flag == 2) cmd_sprite(Win2, x_tc, y_tc);
 
-        draw_sprite(screen, GameTable, x_tc, y_tc);
+        while (!key[KEY_ENTER] && !end);    // the message stays on the frame until the restart
 
+        // In case of restart 
+        pthread_mutex_lock(&mux);
         init_balls();
+        pthread_mutex_unlock(&mux);
+
+        cmd_shape(CMD_FULL, 0, 0, 0, 0, 0);                                 // the winning message covered the table
+        cmd_shape(CMD_FILL, x_tc + XTAB, y_tc, XWIN, y_tc + YTAB, DARK_BLUE); // eliminated balls beside it
 
         v = V_MAX;
         theta = 0;
@@ -769,127 +1087,445 @@ int     i;  // ball index
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Store the wake of the i-th ball
+// Put the point (x, y) on top of the circular buffer c, over the oldest one if it is full
+void    cbuf_put(struct cbuf *c, int x, int y)
+{
+        c->top = (c->top + 1) % WLEN;
+        c->x[c->top] = x;
+        c->y[c->top] = y;
+        if (c->n < WLEN) c->n++;
+        c->seq++;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Store the wake of the i-th ball, only if it moved by TRAIL_STEP pixels since the last point
 void    store_wake(int i)
 {
-int     k;  
+int     x, y;   // graphics coordinates
+struct cbuf *w = &wake[i];
+
+        x = BANK + cf * table.x[i];
+        y = BANK + cf * table.y[i];
+        if (x < 0 || y < 0 || x >= XTAB || y >= YTAB) return;
+
+        if (w->n > 0 && abs(x - w->x[w->top]) < TRAIL_STEP && abs(y - w->y[w->top]) < TRAIL_STEP) return;
 
-        k = wake[i].top;           // new element
-        k = (k + 1) % WLEN;        // put on top of wake
-        wake[i].x[k] = ball[i].x;
-        wake[i].y[k] = ball[i].y;
-        wake[i].top = k;
+        cbuf_put(w, x, y);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // DRAWING FUNCTIONS
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
-// Draw i-th ball trail with w past values
-void    draw_trail(int i, int w, int tcol)
+// Grow the rectangle r to cover the point (x, y)
+void    grow_rect(struct drect *r, int x, int y)
+{
+        if (r->x0 > r->x1) {
+            r->x0 = r->x1 = x;
+            r->y0 = r->y1 = y;
+            return;
+        }
+        if (x < r->x0) r->x0 = x;
+        if (x > r->x1) r->x1 = x;
+        if (y < r->y0) r->y0 = y;
+        if (y > r->y1) r->y1 = y;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Draw a wake point on the trail layer, growing r to cover it
+void    trail_dot(int x, int y, int tcol, struct drect *r)
+{
+        trail_cnt[y][x]++;
+        n_trail++;
+        putpixel(TrailLayer, x, y, tcol);
+        grow_rect(r, x, y);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Remove a wake point from the trail layer, growing r to cover it; the pixel turns transparent when no other
+// point lies on it
+void    trail_undot(int x, int y, struct drect *r)
+{
+        trail_cnt[y][x]--;
+        n_trail--;
+        if (trail_cnt[y][x] == 0) putpixel(TrailLayer, x, y, bitmap_mask_color(TrailLayer));
+        grow_rect(r, x, y);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Copy in w the counters of the wake of the i-th ball and the points of it not on the trail layer yet, at their
+// place in the buffer; called under the table lock, so the ball task waits only for the copy
+void    copy_wake(int i, struct cbuf *w)
 {
 int     j, k;   // wake indexes
-int     x, y;   // graphics coordinates
+long    n_new;  // wake points not drawn yet
+const struct cbuf *c = &wake[i];
+
+        w->top = c->top;
+        w->n = c->n;
+        w->seq = c->seq;
+
+        n_new = c->seq - trail[i].seq;
+        if (n_new < 0 || n_new > c->n) n_new = c->n;
 
-        for (j = 0; j < w; j++) {
-            k = (wake[i].top + WLEN -j) % WLEN;
-            x = BANK + CF * wake[i].x[k];
-            y = BANK + CF * wake[i].y[k];
-            putpixel(GameTable, x, y, tcol);
+        for (j = 0; j < n_new; j++) {
+            k = (c->top - j + WLEN) % WLEN;
+            w->x[k] = c->x[k];
+            w->y[k] = c->y[k];
         }
 }
 
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Bring the trail of the i-th ball on the layer up to date with w, the copy of its wake: draw the new points and
+// age out the oldest ones, or erase it all when it is not shown. rh and rt grow to cover what changed at the head
+// and at the tail of the trail
+void    update_trail(int i, const struct cbuf *w, int show, struct drect *rh, struct drect *rt)
+{
+int     j, k;   // wake indexes
+long    n_new;  // wake points not drawn yet
+struct cbuf *t = &trail[i];
+
+        if (!show || w->seq < t->seq) { // hidden, or the wake has been reset
+            for (j = 0; j < t->n; j++) {
+                k = (t->top - j + WLEN) % WLEN;
+                trail_undot(t->x[k], t->y[k], rt);
+            }
+            t->n = 0;
+            t->seq = w->seq;
+            return;
+        }
+
+        n_new = w->seq - t->seq;
+        if (n_new > w->n) n_new = w->n;  // older ones have already been overwritten
+
+        for (j = n_new - 1; j >= 0; j--) {
+            if (t->n == WLEN) { // age out the oldest point
+                k = (t->top + 1) % WLEN;
+                trail_undot(t->x[k], t->y[k], rt);
+                t->n--;
+            }
+            k = (w->top - j + WLEN) % WLEN;
+            cbuf_put(t, w->x[k], w->y[k]);
+            trail_dot(w->x[k], w->y[k], ball[i].tcol, rh);
+        }
+        t->seq = w->seq;
+}
+
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // Draw the ball
-void    draw_ball(int i, float xm, float ym, BITMAP* btm)
+void    draw_ball(int i, float xm, float ym, RLE_SPRITE* btm)
 {
 int     x, y;   // coordinates of the ball (wrt to table)in pixels
         
-            if (ball[i].active_flag || (i = 0 && !ball[i].active_flag)) { // the white ball and other active balls have to be pasted on the table bitmap
-                x = (int) (BANK + (CF * xm) - DIAM_P/2);
-                y = (int) (BANK + (CF * ym) - DIAM_P/2);
-                draw_sprite(GameTable, btm, x, y);
+            if (table.active[i] || (i = 0 && !table.active[i])) { // the white ball and other active balls have to be pasted on the table bitmap
+                x = (int) (BANK + (cf * xm) - btm->w/2);
+                y = (int) (BANK + (cf * ym) - btm->h/2);
+                draw_rle_sprite(GameTable, btm, x, y);
             }
-            else { // eliminated balls have to be pasted on the screen
-                x = (int) (x_or + (CF * xm) - DIAM_P/2);
-                y = (int) (y_or + (CF * ym) - DIAM_P/2);
-                draw_sprite(screen, btm, x, y);
+            else { // eliminated balls have to be pasted on the frame, beside the drawn table whatever its scale
+                x = (int) (x_or + (CF * (xm - table.table.lx + LX)) - btm->w/2);
+                y = (int) (y_or + (CF * ym) - btm->h/2);
+                draw_rle_sprite(Frame, btm, x, y);
+                add_area(&shown, x, y, x + btm->w - 1, y + btm->h - 1);
             }    
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Draw the trajectory of white ball during the shot and a little circle of the size of the ball to show what it is going to hit first
-void    draw_traj(float theta, float xw, float yw, float xi[], float yi[])
+// Cast a ball from (px, py) along the unit vector (dx, dy) and return the distance it travels in the field before
+// it touches a ball other than 0 and skip or a rail [m]; *hit is the ball touched, - 1 for the rail along x and
+// - 2 for the one along y. Rays against the circles of radius DIAM around the balls and against the rails moved in
+// by a radius
+float   cast_ball(float px, float py, float dx, float dy, float xi[], float yi[], int skip, int *hit)
 {
-int     x0, y0;     // coordinates of the white ball [pixels]
-int     x, y;       // iterative coordinates for trajectory line [pixels]
-float   xf, yf;     // iterative coordinates for trajectory line [m]
-int     k;          // iteration index for trajectory
 int     i;          // ball index
-float   d[N_BALLS]; // distance between white ball and other balls [pixels]
-int     cond;       // ball collision condition
+float   t, tb;      // distance to the first contact and to a ball [m]
+float   mx, my;     // ball centre to the start [m]
+float   b, c, disc; // terms of the ray circle intersection
+float   lx, ly;     // field size [m]
+
+        lx = table.table.lx;
+        ly = table.table.ly;
+
+        // rails
+        t = 1e9;
+        *hit = - 1;
+        if (dx > 0) t = (lx - DIAM/2 - px) / dx;
+        if (dx < 0) t = (DIAM/2 - px) / dx;
+        if (dy > 0 && (ly - DIAM/2 - py) / dy < t) { t = (ly - DIAM/2 - py) / dy; *hit = - 2; }
+        if (dy < 0 && (DIAM/2 - py) / dy < t)      { t = (DIAM/2 - py) / dy; *hit = - 2; }
+        if (t < 0) t = 0;
+
+        // balls: |m + tb d| = DIAM, first root
+        for (i = 1; i < table.n; i++) {
+
+            if (i == skip || !table.active[i]) continue;
+
+            mx = px - xi[i];
+            my = py - yi[i];
+            b = mx * dx + my * dy;
+            c = mx * mx + my * my - DIAM * DIAM;
+            if (b > 0 && c > 0) continue;   // moving away from it
+            disc = b * b - c;
+            if (disc < 0) continue;         // passing by
+
+            tb = - b - sqrt(disc);
+            if (tb < 0) tb = 0;             // already touching
+            if (tb < t) {
+                t = tb;
+                *hit = i;
+            }
+        }
+
+        return t;
+}
 
-        x0 = (int) (BANK + (CF * xw));
-        y0 = (int) (BANK + (CF * yw));
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Find the trajectory of white ball during the shot and where a little circle of the size of the ball shows what
+// it is going to hit first; then the line of the hit ball or the rebound of the white ball on the rail. The result
+// is kept until the direction or the balls change
+void    find_aim(float theta, float xw, float yw, float xi[], float yi[], struct aim *am)
+{
+int     hit, hit2;      // what the white ball and then the hit ball or the rebound touch
+float   dx, dy;         // direction of the shot
+float   nx, ny;         // direction of the second line
+float   t, t2;          // lengths of the lines [m]
+float   px, py;         // white ball centre at the contact [m]
+static struct aim last;             // last aim found
+static float l_theta, l_xw, l_yw;   // shot direction and white ball position it was found for
+static int   l_n = - 1;             // number of balls it was found for
+static float l_x[SIM_MAX_BALLS], l_y[SIM_MAX_BALLS];   // ball positions it was found for [m]
+static int   l_on[SIM_MAX_BALLS];   // ball states it was found for
+
+        if (theta == l_theta && xw == l_xw && yw == l_yw && table.n == l_n &&
+            memcmp(xi, l_x, l_n * sizeof(float)) == 0 && memcmp(yi, l_y, l_n * sizeof(float)) == 0 &&
+            memcmp(table.active, l_on, l_n * sizeof(int)) == 0) {
+            *am = last;
+            return;
+        }
 
-        for (k = 1; k < XTAB; k++) {
-            x = x0 + k * cos(theta);
-            y = y0 + k * sin(theta);
+        dx = cos(theta);
+        dy = sin(theta);
+
+        memset(am, 0, sizeof(*am));
+        am->r = cf * DIAM/2;
+
+        t = cast_ball(xw, yw, dx, dy, xi, yi, 0, &hit);
+        px = xw + t * dx;
+        py = yw + t * dy;
+
+        am->on = 1;
+        am->hit = 1;
+        am->xs = (int) (BANK + cf * xw + dx);
+        am->ys = (int) (BANK + cf * yw + dy);
+        am->xe = (int) (BANK + cf * px);
+        am->ye = (int) (BANK + cf * py);
+
+        if (hit > 0) {  // the hit ball leaves along the line of the centres
+            nx = xi[hit] - px;
+            ny = yi[hit] - py;
+            t2 = sqrt(nx * nx + ny * ny);
+            if (t2 > 0) {
+                nx /= t2;
+                ny /= t2;
+                t2 = cast_ball(xi[hit], yi[hit], nx, ny, xi, yi, hit, &hit2);
+                am->xa = (int) (BANK + cf * xi[hit]);
+                am->ya = (int) (BANK + cf * yi[hit]);
+                am->next = 1;
+            }
+        }
+        else {          // the white ball rebounds on the rail
+            nx = (hit == - 1) ? - dx : dx;
+            ny = (hit == - 2) ? - dy : dy;
+            t2 = cast_ball(px, py, nx, ny, xi, yi, 0, &hit2);
+            am->xa = am->xe;
+            am->ya = am->ye;
+            am->next = 1;
+        }
 
-            xf = (float) (x - BANK)/CF;
-            yf = (float) (y - BANK)/CF;
+        if (am->next) {
+            am->xb = (int) (am->xa + cf * t2 * nx);
+            am->yb = (int) (am->ya + cf * t2 * ny);
+        }
 
-            cond = 0;
+        last = *am;
+        l_theta = theta;
+        l_xw = xw;
+        l_yw = yw;
+        l_n = table.n;
+        memcpy(l_x, xi, l_n * sizeof(float));
+        memcpy(l_y, yi, l_n * sizeof(float));
+        memcpy(l_on, table.active, l_n * sizeof(int));
+}
 
-            for (i = 1; i < N_BALLS; i++) {
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Draw the trajectory of white ball found by find_aim()
+void    draw_aim(const struct aim *am)
+{
+        line(GameTable, am->xs, am->ys, am->xe, am->ye, WHITE);
+        if (am->hit) circle(GameTable, am->xe, am->ye, am->r, WHITE);
+        if (am->next) line(GameTable, am->xa, am->ya, am->xb, am->yb, WHITE);
+}
 
-                d[i] = sqrt((xi[i] - xf)*(xi[i] - xf) + (yi[i] - yf)*(yi[i] - yf));
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return the rectangle covered by the i-th ball on the table bitmap, empty if it is not drawn there
+struct drect ball_rect(int i, float xm, float ym)
+{
+struct drect r = {0, 0, -1, -1};
+BITMAP* btm = ball[i].bm;
 
-                if (d[i] < DIAM) cond = 1;
-            }
+        if (!table.active[i]) return r; // eliminated balls are drawn on the frame, beside the table
 
-            if (xf > 0 && yf > 0 && xf < LX && yf < LY) {
+        r.x0 = (int) (BANK + (cf * xm) - btm->w/2);
+        r.y0 = (int) (BANK + (cf * ym) - btm->h/2);
+        r.x1 = r.x0 + btm->w - 1;
+        r.y1 = r.y0 + btm->h - 1;
 
-                putpixel(GameTable, x, y, WHITE);
+        return r;
+}
 
-                if ((xf < DIAM/2 || yf < DIAM/2 || (LX - xf) < DIAM/2 || (LY - yf) < DIAM/2) || cond) {
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return the rectangle covered by the aim line
+struct drect aim_rect(const struct aim *am)
+{
+struct drect r = {0, 0, -1, -1};
 
-                        circle(GameTable, x, y, DIAM_P/2, WHITE);
-                        break;
-                } 
-            }
+        if (!am->on) return r;
+
+        r.x0 = (am->xs < am->xe) ? am->xs : am->xe;
+        r.x1 = (am->xs < am->xe) ? am->xe : am->xs;
+        r.y0 = (am->ys < am->ye) ? am->ys : am->ye;
+        r.y1 = (am->ys < am->ye) ? am->ye : am->ys;
+
+        if (am->hit) {
+            if (am->xe - am->r - 1 < r.x0) r.x0 = am->xe - am->r - 1;
+            if (am->xe + am->r + 1 > r.x1) r.x1 = am->xe + am->r + 1;
+            if (am->ye - am->r - 1 < r.y0) r.y0 = am->ye - am->r - 1;
+            if (am->ye + am->r + 1 > r.y1) r.y1 = am->ye + am->r + 1;
+        }
+
+        if (am->next) {
+            grow_rect(&r, am->xa, am->ya);
+            grow_rect(&r, am->xb, am->yb);
+        }
+
+        return r;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Add the rectangles covered by the line from (xs, ys) to (xe, ye), in pieces of AIM_SEG pixels so a slanted line
+// does not dirty its whole bounding box
+void    add_line_dirty(int xs, int ys, int xe, int ye)
+{
+int     len;            // line length along its main direction [pixels]
+int     k, e;           // start and end of a piece [pixels along the line]
+struct drect r;         // rectangle of a piece
+
+        len = abs(xe - xs);
+        if (abs(ye - ys) > len) len = abs(ye - ys);
+
+        for (k = 0; k <= len; k += AIM_SEG) {
+
+            e = (k + AIM_SEG < len) ? k + AIM_SEG : len;
+
+            r.x0 = xs + (len ? (xe - xs) * k / len : 0);
+            r.y0 = ys + (len ? (ye - ys) * k / len : 0);
+            r.x1 = xs + (len ? (xe - xs) * e / len : 0);
+            r.y1 = ys + (len ? (ye - ys) * e / len : 0);
+
+            if (r.x0 > r.x1) { e = r.x0; r.x0 = r.x1; r.x1 = e; }
+            if (r.y0 > r.y1) { e = r.y0; r.y0 = r.y1; r.y1 = e; }
+
+            // one pixel more on each side for the rounding of the line
+            r.x0--; r.y0--; r.x1++; r.y1++;
+            add_rect(&dirty, r);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Add the rectangles covered by the aim lines and circle
+void    add_aim_dirty(const struct aim *am)
+{
+struct drect r;         // rectangle of the circle
+
+        if (!am->on) return;
+
+        add_line_dirty(am->xs, am->ys, am->xe, am->ye);
+        if (am->next) add_line_dirty(am->xa, am->ya, am->xb, am->yb);
+
+        if (am->hit) {
+            r.x0 = am->xe - am->r - 1;
+            r.y0 = am->ye - am->r - 1;
+            r.x1 = am->xe + am->r + 1;
+            r.y1 = am->ye + am->r + 1;
+            add_rect(&dirty, r);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Restore the rectangle r of the table bitmap from the empty table, draw again what lies on it (clipped to it)
+// and paste it on the frame
+void    redraw_rect(const struct drect *r, const struct aim *am)
+{
+int     i;              // ball index
+int     w, h;           // rectangle size [pixels]
+struct drect box;       // rectangle covered by the aim line
+
+        w = r->x1 - r->x0 + 1;
+        h = r->y1 - r->y0 + 1;
+
+        set_clip_rect(GameTable, r->x0, r->y0, r->x1, r->y1);
+        blit(CleanTable, GameTable, r->x0, r->y0, r->x0, r->y0, w, h);
+
+        if (n_trail > 0) masked_blit(TrailLayer, GameTable, r->x0, r->y0, r->x0, r->y0, w, h);
+        if (pv_shown.seq > 0) masked_blit(PathLayer, GameTable, r->x0, r->y0, r->x0, r->y0, w, h);
+
+        for (i = 0; i < table.n; i++) {
+            if (overlap(&ball_r[i], r)) draw_rle_sprite(GameTable, ball[i].rle, ball_r[i].x0, ball_r[i].y0);
         }
+
+        box = aim_rect(am);
+        if (overlap(&box, r)) draw_aim(am);
+
+        blit(GameTable, Frame, r->x0, r->y0, x_tc + r->x0, y_tc + r->y0, w, h);
+        add_area(&shown, x_tc + r->x0, y_tc + r->y0, x_tc + r->x1, y_tc + r->y1);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// Draw the shot power indicator with different colors for various powers
-void    draw_pow_ind(float v)
+// Draw the shot power indicator with different colors for various powers, nothing if it is not shown
+void    draw_pow_ind(struct widget *w, int show, float v)
 {
 int     ind;
 char    s[20];
+int     x0 = w->x, y0 = w->y;  // widget corner on the frame
+BITMAP* bm = w->bm;
+
+        clear_to_color(bm, DARK_BLUE);
+        if (!show) return;
 
         sprintf(s, "v = %4.2f", v);
-        textout_centre_ex(screen, font, "SHOT POWER", 56, 483 - IN_HEI - 25, WHITE, -1);
-        textout_centre_ex(screen, font, s, 56, 483 - IN_HEI - 15, DARK_BLUE, WHITE);
-        rectfill(screen, 31, 484, 31 + IN_WID, 484 - IN_HEI, BLACK);
-        rect(screen, 30, 485, 32 + IN_WID, 483 - IN_HEI, WHITE);
+        textout_centre_ex(bm, font, "SHOT POWER", 56 - x0, 483 - IN_HEI - 25 - y0, WHITE, -1);
+        textout_centre_ex(bm, font, s, 56 - x0, 483 - IN_HEI - 15 - y0, DARK_BLUE, WHITE);
+        rectfill(bm, 31 - x0, 484 - y0, 31 + IN_WID - x0, 484 - IN_HEI - y0, BLACK);
+        rect(bm, 30 - x0, 485 - y0, 32 + IN_WID - x0, 483 - IN_HEI - y0, WHITE);
 
         ind = (int) (IN_HEI * (v / V_MAX));
 
-        if (v < 0.25 * V_MAX) rectfill(screen, 31, 484, 31 + IN_WID, 484 - ind, GREEN);
-        else if (v >= 0.25 * V_MAX && v < 0.5 * V_MAX) rectfill(screen, 31, 484, 31 + IN_WID, 484 - ind, YELLOW);
-        else if (v >= 0.5 * V_MAX && v < 0.75 * V_MAX) rectfill(screen, 31, 484, 31 + IN_WID, 484 - ind, ORANGE);
-        else if (v >= 0.75 * V_MAX) rectfill(screen, 31, 484, 31 + IN_WID, 484 - ind, RED);
+        if (v < 0.25 * V_MAX) rectfill(bm, 31 - x0, 484 - y0, 31 + IN_WID - x0, 484 - ind - y0, GREEN);
+        else if (v >= 0.25 * V_MAX && v < 0.5 * V_MAX) rectfill(bm, 31 - x0, 484 - y0, 31 + IN_WID - x0, 484 - ind - y0, YELLOW);
+        else if (v >= 0.5 * V_MAX && v < 0.75 * V_MAX) rectfill(bm, 31 - x0, 484 - y0, 31 + IN_WID - x0, 484 - ind - y0, ORANGE);
+        else if (v >= 0.75 * V_MAX) rectfill(bm, 31 - x0, 484 - y0, 31 + IN_WID - x0, 484 - ind - y0, RED);
 }
         
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // Draw parameters indicators
-void    draw_par_ind(float f, float dump, float T_scale)
+void    draw_par_ind(struct widget *w, float f, float dump, float T_scale)
 {
 int     ind_f;
 int     ind_d;
 int     ind_t;
 int     a;
+int     x0 = w->x, y0 = w->y;  // widget corner on the frame
+BITMAP* bm = w->bm;
 
 char    sf[25];
 char    sd[25];
@@ -901,24 +1537,68 @@ char    st[30];
 
         a = 10;
 
+        clear_to_color(bm, DARK_BLUE);
+
         sprintf(sf, "friction factor = %5.3f", f);
-        textout_ex(screen, font, sf, 20, (600 + 13 - 10) + a, DARK_BLUE, WHITE);
-        rectfill(screen, 20, (600 + 13) + a, (20 + 200), (600 + 8 + 30) + a, BLACK);
-        rect(screen, (20 - 1), (600 + 13 - 1) + a, (20 + 200 + 1), (600 + 8 + 30 + 1) + a, WHITE);
-        rectfill(screen, 20, (600 + 13) + a, (20 + ind_f), (600 + 8 + 30) + a, CYAN);
+        textout_ex(bm, font, sf, 20 - x0, (600 + 13 - 10) + a - y0, DARK_BLUE, WHITE);
+        rectfill(bm, 20 - x0, (600 + 13) + a - y0, (20 + 200) - x0, (600 + 8 + 30) + a - y0, BLACK);
+        rect(bm, (20 - 1) - x0, (600 + 13 - 1) + a - y0, (20 + 200 + 1) - x0, (600 + 8 + 30 + 1) + a - y0, WHITE);
+        rectfill(bm, 20 - x0, (600 + 13) + a - y0, (20 + ind_f) - x0, (600 + 8 + 30) + a - y0, CYAN);
 
         sprintf(sd, "dumping factor = %4.2f", dump);
-        textout_ex(screen, font, sd, 20, (656 + 13 - 10) + a, DARK_BLUE, WHITE);
-        rectfill(screen, 20, (656 + 13) + a, (20 + 200), (656 + 8 + 30) + a, BLACK);
-        rect(screen, (20 - 1), (656 + 13 - 1) + a, (20 + 200 + 1), (656 + 8 + 30 + 1) + a, WHITE);
-        rectfill(screen, 20, (656 + 13) + a, (20 + ind_d), (656 + 8 + 30) + a, CYAN);
+        textout_ex(bm, font, sd, 20 - x0, (656 + 13 - 10) + a - y0, DARK_BLUE, WHITE);
+        rectfill(bm, 20 - x0, (656 + 13) + a - y0, (20 + 200) - x0, (656 + 8 + 30) + a - y0, BLACK);
+        rect(bm, (20 - 1) - x0, (656 + 13 - 1) + a - y0, (20 + 200 + 1) - x0, (656 + 8 + 30 + 1) + a - y0, WHITE);
+        rectfill(bm, 20 - x0, (656 + 13) + a - y0, (20 + ind_d) - x0, (656 + 8 + 30) + a - y0, CYAN);
 
         sprintf(st, "time scale factor = %4.2f", T_scale);
-        textout_ex(screen, font, st, 20, (712 + 13 - 10) + a, DARK_BLUE, WHITE);
-        rectfill(screen, 20, (712 + 13) + a, (20 + 200), (712 + 8 + 30) + a, BLACK);
-        rect(screen, (20 - 1), (712 + 13 - 1) + a, (20 + 200 + 1), (712 + 8 + 30 + 1) + a, WHITE);
-        rectfill(screen, 20, (712 + 13) + a, (20 + ind_t), (712 + 8 + 30) + a, CYAN);
+        textout_ex(bm, font, st, 20 - x0, (712 + 13 - 10) + a - y0, DARK_BLUE, WHITE);
+        rectfill(bm, 20 - x0, (712 + 13) + a - y0, (20 + 200) - x0, (712 + 8 + 30) + a - y0, BLACK);
+        rect(bm, (20 - 1) - x0, (712 + 13 - 1) + a - y0, (20 + 200 + 1) - x0, (712 + 8 + 30 + 1) + a - y0, WHITE);
+        rectfill(bm, 20 - x0, (712 + 13) + a - y0, (20 + ind_t) - x0, (712 + 8 + 30) + a - y0, CYAN);
+
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Draw whose the turn is and, if determined, which type of balls belong to who
+void    draw_player_ind(struct widget *w, int player, int type)
+{
+int     x0 = w->x, y0 = w->y;  // widget corner on the frame
+BITMAP* bm = w->bm;
+
+        clear_to_color(bm, DARK_BLUE);
+
+        if (!player) {
+
+            rectfill(bm, 10 - x0, 520 - y0, x_tc - 10 - x0, 520 + 40 - y0, BLUE);
+            rect(bm, 10 - x0, 519 - y0, x_tc - 10 - x0, 520 + 41 - y0, WHITE);
+            textout_centre_ex(bm, font, "PLAYER 1", x_tc/2 - x0, 530 - y0, WHITE, - 1);
+
+            if (type == 1) textout_centre_ex(bm, font, "solid", x_tc/2 - x0, 550 - y0, WHITE, - 1);
+            if (type == 2) textout_centre_ex(bm, font, "striped", x_tc/2 - x0, 550 - y0, WHITE, - 1);
+        }
+        else {
+
+            rectfill(bm, 10 - x0, 520 - y0, x_tc - 10 - x0, 520 + 40 - y0, RED);
+            rect(bm, 10 - x0, 519 - y0, x_tc - 10 - x0, 520 + 41 - y0, WHITE);
+            textout_centre_ex(bm, font, "PLAYER 2", x_tc/2 - x0, 530 - y0, WHITE, - 1);
+
+            if (type == 2) textout_centre_ex(bm, font, "solid", x_tc/2 - x0, 550 - y0, WHITE, - 1);
+            if (type == 1) textout_centre_ex(bm, font, "striped", x_tc/2 - x0, 550 - y0, WHITE, - 1);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Draw if the ball trail is being displayed or not
+void    draw_trail_ind(struct widget *w, int trail)
+{
+int     x0 = w->x, y0 = w->y;  // widget corner on the frame
+BITMAP* bm = w->bm;
 
+        rectfill(bm, 5 - x0, 580 - y0, x_tc - 5 - x0, 580 + 20 - y0, BLACK);
+        rect(bm, 5 - x0, 580 - y0, x_tc - 5 - x0, 580 + 20 - y0, WHITE);
+        if (trail) textout_centre_ex(bm, font, "trail = ON", x_tc/2 - x0, 587 - y0, WHITE, - 1);
+        else       textout_centre_ex(bm, font, "trail = OFF", x_tc/2 - x0, 587 - y0, WHITE, - 1);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
@@ -927,55 +1607,64 @@ void    draw_dec_hole_ind(int dec_hole)
 {
 int     x, y, r;
 
-        x = (int) x_or + CF * hole[dec_hole].x;
-        y = (int) y_or + CF * hole[dec_hole].y;
+        x = (int) x_or + cf * table.hole[dec_hole].x;
+        y = (int) y_or + cf * table.hole[dec_hole].y;
 
-        circlefill(screen, x, y, 5, RED);
+        cmd_shape(CMD_FULL, 0, 0, 0, 0, 0);     // erase the last indicator
+        cmd_shape(CMD_DISC, x, y, 5, 0, RED);
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 // TASK FUNCTIONS DEFINITIONS
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
-// Impose status update
-void*   ball_task(void* arg) 
+// Advance the table by dt, apply the game rules to what happened and store the wakes
+void    ball_step(float dt)
 {
-int     a;         // task index
-int     i, j;      // ball index
-float   dt;        // integration step
+int     i;         // ball index
 
-        a = get_task_index(arg);
+        pthread_mutex_lock(&mux);
 
-        wait_for_activation(a);
+        table.f = f;
+        table.dump = dump;
 
-        while (!end) {
+        nsub = sim_advance(&table, dt);     // split the step when the balls run fast
 
-            dt = T_scale*(float)task_period(a)/1000;
+        // Apply the game rules to what happened during the step
+        handle_holes();
+        handle_collision();
+        if (phase_flag == 0) nbb += table.nbounce; // count the bounces on the bounds to check if the break has to be repeated
+        sim_clear_events(&table);
 
-            pthread_mutex_lock(&mux);
+        if (trail_flag) {
+            for (i = 0; i < table.n; i++) {
+                if (table.active[i]) store_wake(i);
+            }
+        }
 
-            handle_holes();
+        snap_publish(dt);
 
-            for (i = 0; i < N_BALLS; i++) {
+        pthread_mutex_unlock(&mux);
+}
 
-                if (ball[i].active_flag) {
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Impose status update
+void*   ball_task(void* arg) 
+{
+int     a;         // task index
+long    t0;        // job start time [us]
 
-                    update_status(i, f, dt);
+        a = get_task_index(arg);
 
-                    if (trail_flag) store_wake(i);
+        wait_for_activation(a);
 
-                    handle_bounce(i, dump);
+        while (!end) {
 
-                    for (j = 0; j < N_BALLS; j++) {
-                        if (j != i && ball[j].active_flag) {
-                            handle_collision(i, j, dump);
-                        }
-                    }
-                }
-            }
+            t0 = get_systime(MICRO);
 
-            pthread_mutex_unlock(&mux);
+            ball_step(T_scale*(float)task_period(a)/1000);
 
+            task_update_wcet(a, get_systime(MICRO) - t0);
             deadline_miss(a);
 
             wait_for_period(a);
@@ -991,6 +1680,7 @@ int     i;                   // ball index
 float   x_m, y_m;            // mouse position on the field [m]
 float   Delta_x, Delta_y;    // difference from mouse and white ball position on the field [m]
 char    scan;                // indicate the pressed key
+long    t0;                  // job start time [us]
 
         a = get_task_index(arg);
 
@@ -998,23 +1688,26 @@ char    scan;                // indicate the pressed key
         
         while (!end) {
 
+            t0 = get_systime(MICRO);
+
             scan = get_scancode();
 
-            if (ball[0].active_flag && cond1[N_BALLS - 1]) { // if the game is still
+            if (table.active[0] && cond1[N_BALLS - 1]) { // if the game is still
 
                 // Press spacebar to shoot
                 if (scan == KEY_SPACE) {
-                    ball[0].vx = v * cos(theta);
-                    ball[0].vy = v * sin(theta);
+                    pthread_mutex_lock(&mux);   // the shot wakes the white ball up
+                    sim_shoot(&table, theta, v);
+                    pthread_mutex_unlock(&mux);
                 }
 
                 // When the mouse wheel is pressed the mouse will direct the shot
                 if (mouse_b & 4) {     
 
-                    x_m = (((float) mouse_x - x_or) / CF);
-                    y_m = (((float) mouse_y - y_or) / CF);
-                    Delta_x = x_m - ball[0].x;
-                    Delta_y = y_m - ball[0].y;
+                    x_m = (((float) mouse_x - x_or) / cf);
+                    y_m = (((float) mouse_y - y_or) / cf);
+                    Delta_x = x_m - table.x[0];
+                    Delta_y = y_m - table.y[0];
 
                     theta = atan2(Delta_y, Delta_x);
                 }
@@ -1033,6 +1726,8 @@ char    scan;                // indicate the pressed key
              deadline_miss(a);
             }
 
+            task_update_wcet(a, get_systime(MICRO) - t0);
+
             wait_for_period(a);
         }
 }
@@ -1043,6 +1738,7 @@ void*   set_param_task(void* arg)
 {
 int     a;      // task index
 char    scan;   // indicate key pressed
+long    t0;     // job start time [us]
 
         a = get_task_index(arg);
 
@@ -1050,6 +1746,8 @@ char    scan;   // indicate key pressed
 
         while (!end) {
 
+            t0 = get_systime(MICRO);
+
             if (cond1[N_BALLS - 1]) { // if the game is still
 
                 scan = get_scancode();
@@ -1061,6 +1759,11 @@ char    scan;   // indicate key pressed
                         else            trail_flag = 1;
                         break;
 
+                    case KEY_V: // press V to show or hide the preview of the whole shot
+                        if (preview_flag) preview_flag = 0;
+                        else              preview_flag = 1;
+                        break;
+
 
                     case KEY_Q:
                         if (f < F_MAX) f += D_F;
@@ -1092,6 +1795,8 @@ char    scan;   // indicate key pressed
                 deadline_miss(a);
             }
 
+            task_update_wcet(a, get_systime(MICRO) - t0);
+
             wait_for_period(a);
         }
 }
@@ -1106,6 +1811,8 @@ int     j;              // hole index
 float   thres;          // velocity threshold
 char    scan, scan1;    // gets pressed key
 int     t;              // this element helps assign the ball type to a player
+int     ind;            // hole shown by the declared hole indicator
+long    t0;             // job start time [us]
 
         a = get_task_index(arg);
 
@@ -1115,154 +1822,131 @@ int     t;              // this element helps assign the ball type to a player
 
         while (!end) {
 
+            t0 = get_systime(MICRO);
+
             scan = get_scancode();
 
             /**************TO USE IN TEST PHASE ONLY*********************/
             // Eliminate balls manually (do it only coherently with game development to avoid unexpected behaviour)
+            pthread_mutex_lock(&mux);   // parking a ball changes the awake balls of the ball task
             if (scan == KEY_1) {
-                if (ball[1].active_flag) {
-                    ball[1].active_flag = 0;
-                    ball[1].x = ball[1].xo;
-                    ball[1].y = ball[1].yo;
+                if (table.active[1]) {
+                    sim_park(&table, 1);
                     ball[1].el_ph = phase_flag;
                     nhsol++; 
                     }
             }
             if (scan == KEY_2) {
-                if (ball[2].active_flag) {
-                    ball[2].active_flag = 0;
-                    ball[2].x = ball[2].xo;
-                    ball[2].y = ball[2].yo;
+                if (table.active[2]) {
+                    sim_park(&table, 2);
                     ball[2].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_3) {
-                if (ball[3].active_flag) {
-                    ball[3].active_flag = 0;
-                    ball[3].x = ball[3].xo;
-                    ball[3].y = ball[3].yo;
+                if (table.active[3]) {
+                    sim_park(&table, 3);
                     ball[3].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_4) {
-                if (ball[4].active_flag) {
-                    ball[4].active_flag = 0;
-                    ball[4].x = ball[4].xo;
-                    ball[4].y = ball[4].yo;
+                if (table.active[4]) {
+                    sim_park(&table, 4);
                     ball[4].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_5) {
-                if (ball[5].active_flag) {
-                    ball[5].active_flag = 0;
-                    ball[5].x = ball[5].xo;
-                    ball[5].y = ball[5].yo;
+                if (table.active[5]) {
+                    sim_park(&table, 5);
                     ball[5].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_6) {
-                if (ball[6].active_flag) {
-                    ball[6].active_flag = 0;
-                    ball[6].x = ball[6].xo;
-                    ball[6].y = ball[6].yo;
+                if (table.active[6]) {
+                    sim_park(&table, 6);
                     ball[6].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_7) {
-                if (ball[7].active_flag) {
-                    ball[7].active_flag = 0;
-                    ball[7].x = ball[7].xo;
-                    ball[7].y = ball[7].yo;
+                if (table.active[7]) {
+                    sim_park(&table, 7);
                     ball[7].el_ph = phase_flag;
                     nhsol++;
                 }
             }
             if (scan == KEY_9) {
-                if (ball[9].active_flag) {
-                    ball[9].active_flag = 0;
-                    ball[9].x = ball[9].xo;
-                    ball[9].y = ball[9].yo;
+                if (table.active[9]) {
+                    sim_park(&table, 9);
                     ball[9].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_0) {
-                if (ball[10].active_flag) {
-                    ball[10].active_flag = 0;
-                    ball[10].x = ball[10].xo;
-                    ball[10].y = ball[10].yo;
+                if (table.active[10]) {
+                    sim_park(&table, 10);
                     ball[10].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_P) {
-                if (ball[11].active_flag) {
-                    ball[11].active_flag = 0;
-                    ball[11].x = ball[11].xo;
-                    ball[11].y = ball[11].yo;
+                if (table.active[11]) {
+                    sim_park(&table, 11);
                     ball[11].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_O) {
-                if (ball[12].active_flag) {
-                    ball[12].active_flag = 0;
-                    ball[12].x = ball[12].xo;
-                    ball[12].y = ball[12].yo;
+                if (table.active[12]) {
+                    sim_park(&table, 12);
                     ball[12].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_L) {
-                if (ball[13].active_flag) {
-                    ball[13].active_flag = 0;
-                    ball[13].x = ball[13].xo;
-                    ball[13].y = ball[13].yo;
+                if (table.active[13]) {
+                    sim_park(&table, 13);
                     ball[13].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_K) {
-                if (ball[14].active_flag) {
-                    ball[14].active_flag = 0;
-                    ball[14].x = ball[14].xo;
-                    ball[14].y = ball[14].yo;
+                if (table.active[14]) {
+                    sim_park(&table, 14);
                     ball[14].el_ph = phase_flag;
                     nhstr++;
                 }
             }
             if (scan == KEY_M) {
-                if (ball[15].active_flag) {
-                    ball[15].active_flag = 0;
-                    ball[15].x = ball[15].xo;
-                    ball[15].y = ball[15].yo;
+                if (table.active[15]) {
+                    sim_park(&table, 15);
                     ball[15].el_ph = phase_flag;
                     nhstr++;
                 }
             }
+            pthread_mutex_unlock(&mux);
             /***********************************************************/
         
             // All balls have to be still (enough) to switch the turn
             for (i = 0; i < N_BALLS; i++) {
             
-                if (ball[i].active_flag) {
-                    if (fabs(ball[i].vx) < thres && fabs(ball[i].vy) < thres) cond1[i] = 1;
+                if (table.active[i]) {
+                    if (fabs(table.vx[i]) < thres && fabs(table.vy[i]) < thres) cond1[i] = 1;
                     else cond1[i] = 0;
                 }
                 else cond1[i] = 1;
 
                 if (i != 0) cond1[i] = cond1[i] * cond1[i - 1];
             }
+            if (n_balls > N_BALLS && !sim_at_rest(&table, thres)) cond1[N_BALLS - 1] = 0; // the extra balls have to stop too
 
             // Check if the ball is still and then enables shot and parameters change tasks
             if (cond1[N_BALLS - 1]) {
 
-                unscare_mouse();
+                cmd_shape(CMD_SHOW, 0, 0, 0, 0, 0);
 
                 // PHASE SWITCHING
 
@@ -1346,8 +2030,8 @@ int     t;              // this element helps assign the ball type to a player
                                 
                                 for (i = 0; i < N_BALLS; i++) {
                                 
-                                    if (ball[i].active_flag) cond2[i] = 1;
-                                    else if (!ball[i].active_flag && ball[i].el_ph != 1) cond2[i] = 1;
+                                    if (table.active[i]) cond2[i] = 1;
+                                    else if (!table.active[i] && ball[i].el_ph != 1) cond2[i] = 1;
                                     else cond2[i] = 0;
 
                                     if (i != 0) cond2[i] = cond2[i] * cond2[i - 1];
@@ -1362,7 +2046,9 @@ int     t;              // this element helps assign the ball type to a player
                             if (phase_flag == 0) {
                                 if (nbb >= 4) phase_flag = 1;
                                 else {
+                                    pthread_mutex_lock(&mux);
                                     init_balls();
+                                    pthread_mutex_unlock(&mux);
                                     nbb = 0;
                                 }
                                 dsp_flag = 0;
@@ -1404,7 +2090,7 @@ int     t;              // this element helps assign the ball type to a player
                     }
 
                     // If the 8 ball is eliminated the winner has to be decreed
-                    if (!ball[8].active_flag) {
+                    if (!table.active[8]) {
                         show_game = 0;
                         endgame();
                         
@@ -1415,7 +2101,9 @@ int     t;              // this element helps assign the ball type to a player
                     // When either of the player has to take a winning shot the hole in which he wants to pocket the ball
                     if ((en81_flag && !player_flag) || (en82_flag && player_flag)) {
 
-                        while (!key[KEY_ENTER]) {
+                        ind = - 1;
+
+                        while (!key[KEY_ENTER] && !end) {
 
                             scan1 = get_scancode();
 
@@ -1434,8 +2122,13 @@ int     t;              // this element helps assign the ball type to a player
                                 default: break;
                             }
 
-                            draw_dec_hole_ind(dec_hole);
+                            if (dec_hole != ind) { // queue the indicator only when it moves
+                                draw_dec_hole_ind(dec_hole);
+                                ind = dec_hole;
+                            }
                         }
+
+                        cmd_shape(CMD_FULL, 0, 0, 0, 0, 0); // erase the indicator
                     }
 
                     // Previous value storage
@@ -1449,9 +2142,7 @@ int     t;              // this element helps assign the ball type to a player
             }
             else { // when the balls are moving we can't see the shot power indicator
 
-                scare_mouse();
-
-                rectfill(screen, 0, 490, 111, 168, DARK_BLUE); // cover shot power indicator
+                cmd_shape(CMD_HIDE, 0, 0, 0, 0, 0); // the display task hides the shot power indicator
 
                 dsp_flag = 1;
                 dst_flag = 1;
@@ -1460,6 +2151,7 @@ int     t;              // this element helps assign the ball type to a player
 
             prev_cond1 = cond1[N_BALLS - 1]; // stores condition
 
+            task_update_wcet(a, get_systime(MICRO) - t0);
             deadline_miss(a);
                 
             wait_for_period(a); 
@@ -1467,15 +2159,97 @@ int     t;              // this element helps assign the ball type to a player
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// DYSPLAY TASK FUNCTIONS
+// FRAME CAPTURE FUNCTIONS
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
-// Display ball on screen and restore background when it changes position
-void*   display_task(void* arg)
+// Open the capture file of the frames of bm and allocate the ring buffer; the ring keeps the 32 bit pixels
+// of the frames, so return - 1 if bm has another color depth, 0 on success
+int     cap_open(const char* name, BITMAP* bm)
+{
+int     k;  // ring slot
+
+        if (bitmap_color_depth(bm) != 32) return - 1;
+
+        for (k = 0; k < CAP_LEN; k++) {
+            cap_buf[k] = malloc(XWIN * YWIN * 4);
+            if (cap_buf[k] == NULL) return - 1;
+        }
+
+        cap_fp = fopen(name, "wb");
+        if (cap_fp == NULL) return - 1;
+
+        return 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Copy the frame in the ring buffer, or drop it if the ring is full: the display task never waits for the disk
+void    cap_push(BITMAP* bm)
+{
+unsigned long head;     // frames put in the ring
+unsigned char* dst;     // ring slot
+int     y;              // frame line
+
+        if (cap_seen++ % CAP_EVERY != 0) return;
+
+        head = atomic_load_explicit(&cap_head, memory_order_relaxed);
+        if (head == CAP_MAX) return;
+        if (head - atomic_load_explicit(&cap_tail, memory_order_acquire) == CAP_LEN) {
+            cap_drop++;
+            return;
+        }
+
+        dst = cap_buf[head % CAP_LEN];
+        for (y = 0; y < YWIN; y++) memcpy(dst + (long) y * XWIN * 4, bm->line[y], XWIN * 4);
+
+        atomic_store_explicit(&cap_head, head + 1, memory_order_release);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Write the frames in the ring buffer to the capture file, oldest first, each one as a binary PPM image
+void    cap_write(void)
+{
+unsigned long tail;     // frames written
+const int* src;         // ring slot, 32 bit pixels
+static unsigned char rgb[XWIN * 3]; // frame line, 24 bit pixels
+int     x, y;           // pixel coordinates
+
+        tail = atomic_load_explicit(&cap_tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&cap_head, memory_order_acquire)) {
+            src = (const int*) cap_buf[tail % CAP_LEN];
+            fprintf(cap_fp, "P6\n%d %d\n255\n", XWIN, YWIN);
+            for (y = 0; y < YWIN; y++, src += XWIN) {
+                for (x = 0; x < XWIN; x++) {
+                    rgb[3*x] = getr32(src[x]);
+                    rgb[3*x + 1] = getg32(src[x]);
+                    rgb[3*x + 2] = getb32(src[x]);
+                }
+                fwrite(rgb, 3, XWIN, cap_fp);
+            }
+            tail++;
+            atomic_store_explicit(&cap_tail, tail, memory_order_release);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Flush the frames left in the ring, close the capture file and free the ring buffer
+void    cap_close(void)
+{
+int     k;  // ring slot
+
+        cap_write();
+        fclose(cap_fp);
+        for (k = 0; k < CAP_LEN; k++) free(cap_buf[k]);
+
+        printf("capture: %lu frames written, %ld dropped%s\n", (unsigned long) cap_tail, cap_drop,
+               (cap_tail == CAP_MAX) ? ", limit reached" : "");
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Capture task, the lowest priority one: it streams the captured frames to disk
+void*   capture_task(void* arg)
 {
 int     a;      // task index
-int     i;      // ball index
-float   x[N_BALLS], y[N_BALLS]; // copy variables
+long    t0;     // job start time [us]
 
         a = get_task_index(arg);
 
@@ -1483,59 +2257,385 @@ float   x[N_BALLS], y[N_BALLS]; // copy variables
 
         while (!end) {
 
-            pthread_mutex_lock(&mux);
-            for (i = 0; i < N_BALLS; i++) {
-                x[i] = ball[i].x;
-                y[i] = ball[i].y;
+            t0 = get_systime(MICRO);
+
+            cap_write();
+
+            task_update_wcet(a, get_systime(MICRO) - t0);
+            deadline_miss(a);
+
+            wait_for_period(a);
+        }
+
+        return NULL;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// SHOT PREVIEW FUNCTIONS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+// Add the point (x, y) [m] to the path of the i-th ball if it moved by PATH_STEP pixels since the last one, or
+// anyway if last; a full path keeps its last point up to date
+void    path_point(struct path *pv, int i, float x, float y, int last)
+{
+int     px, py; // point [pixels]
+int     k;      // index of the point
+
+        px = BANK + cf * x;
+        py = BANK + cf * y;
+
+        k = pv->n[i];
+        if (k > 0 && abs(px - pv->x[i][k - 1]) < PATH_STEP && abs(py - pv->y[i][k - 1]) < PATH_STEP) {
+            if (!last || (px == pv->x[i][k - 1] && py == pv->y[i][k - 1])) return;
+        }
+        if (k == PATH_LEN) k--;
+
+        pv->x[i][k] = px;
+        pv->y[i][k] = py;
+        pv->n[i] = k + 1;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Run the shot aimed now on a copy of the table and publish the paths of the balls that move, unless it is the
+// shot already previewed; give up as soon as the aim changes
+void    run_preview(struct path *pv)
+{
+int     i, k;       // ball and step indexes
+float   th, vs;     // shot previewed
+unsigned long moves;    // table.moves of the table
+float   dt;         // step [s]
+int     n;          // number of balls
+float   x0[SIM_MAX_BALLS], y0[SIM_MAX_BALLS];   // ball positions before the shot [m]
+int     on[SIM_MAX_BALLS];                      // ball states before the shot
+struct sim_table geo;                           // table size and holes
+
+        th = theta;
+        vs = v;
+
+        // Just the ball positions under the lock, the rest of the copy is rebuilt outside it
+        pthread_mutex_lock(&mux);
+        n = table.n;
+        moves = table.moves;
+        geo = table.table;
+        memcpy(x0, table.x, n * sizeof(float));
+        memcpy(y0, table.y, n * sizeof(float));
+        memcpy(on, table.active, n * sizeof(int));
+        pthread_mutex_unlock(&mux);
+
+        if (pv->seq > 0 && th == pv->theta && vs == pv->v && moves == pv->moves) return;
+
+        if (memcmp(&geo, &pv_table.table, sizeof(geo)) != 0) { // the table grew for the stress mode
+            sim_set_table(&pv_table, geo.lx, geo.ly, geo.hc, geo.hp);
+            sim_rack(&pv_table);    // parking positions of the new table
+        }
+        for (i = 0; i < n; i++) {
+            if (on[i]) sim_place(&pv_table, i, x0[i], y0[i]);
+            else       sim_park(&pv_table, i);
+        }
+        pv_table.f = f;
+        pv_table.dump = dump;
+        pv_table.nwarm = 0;
+        sim_clear_events(&pv_table);
+
+        dt = T_scale * PER / 1000.0;
+
+        for (i = 0; i < N_BALLS; i++) pv->n[i] = 0;
+
+        sim_shoot(&pv_table, th, vs);
+
+        for (k = 0; k < PREV_STEPS && !sim_at_rest(&pv_table, 1e-3); k++) {
+
+            if (end || !preview_flag || th != theta || vs != v) return; // cancelled: the aim changed
+
+            sim_advance(&pv_table, dt);
+            sim_clear_events(&pv_table);
+
+            for (i = 0; i < N_BALLS; i++) { // paths start where the balls begin to move and end in the holes
+                if (!pv_table.active[i]) continue;
+                if (pv->n[i] == 0 && pv_table.x[i] == x0[i] && pv_table.y[i] == y0[i]) continue;
+                if (pv->n[i] == 0) path_point(pv, i, x0[i], y0[i], 0);
+                path_point(pv, i, pv_table.x[i], pv_table.y[i], 0);
             }
-            pthread_mutex_unlock(&mux);
+        }
 
-            if (show_game) {
-                
-                draw_sprite(GameTable, CleanTable, 0, 0); // draw table to delete old bitmaps
+        for (i = 0; i < N_BALLS; i++) {
+            if (pv->n[i] > 0 && pv_table.active[i]) path_point(pv, i, pv_table.x[i], pv_table.y[i], 1);
+        }
 
-                for (i = 0; i < N_BALLS; i++) { // Draw all bitmaps and trail on table bitmap
-                    if (trail_flag && ball[i].active_flag) draw_trail(i, WLEN, ball[i].tcol);
-                    draw_ball(i, x[i], y[i], ball[i].bm);
-                }
+        pv->theta = th;
+        pv->v = vs;
+        pv->moves = moves;
+        pv->seq++;
 
-                // Display white ball trajectory for shot and shot power indicator
-                if (ball[0].active_flag && cond1[N_BALLS - 1]) {
-                    draw_traj(theta, x[0], y[0], x, y);
-                    draw_pow_ind(v);
-                }
+        pthread_mutex_lock(&pmux);
+        pv_res = *pv;
+        pthread_mutex_unlock(&pmux);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Shot preview task, the lowest priority one: while the balls are still it previews the shot aimed
+void*   preview_task(void* arg)
+{
+int     a;                  // task index
+long    t0;                 // job start time [us]
+static struct path pv;      // preview being found
+
+        a = get_task_index(arg);
+
+        wait_for_activation(a);
+
+        while (!end) {
+
+            t0 = get_systime(MICRO);
+
+            if (preview_flag && table.active[0] && cond1[N_BALLS - 1]) run_preview(&pv);
 
-                draw_sprite(screen, GameTable, x_tc, y_tc); // paste table on screen
+            task_update_wcet(a, get_systime(MICRO) - t0);
+            deadline_miss(a);
+
+            wait_for_period(a);
+        }
+
+        return NULL;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Draw the paths of the preview on the path layer, each ending with a circle where the ball stops
+void    draw_paths(const struct path *pv)
+{
+int     i, k;   // ball and point indexes
+int     n;      // points of a path
 
-                draw_par_ind(f, dump, T_scale); // draw parameters indicator
+        for (i = 0; i < N_BALLS; i++) {
+            n = pv->n[i];
+            if (n < 2) continue;
+            for (k = 1; k < n; k++) line(PathLayer, pv->x[i][k - 1], pv->y[i][k - 1], pv->x[i][k], pv->y[i][k], ball[i].tcol);
+            circle(PathLayer, pv->x[i][n - 1], pv->y[i][n - 1], cf * DIAM/2, ball[i].tcol);
+        }
+}
 
-                // Shows whose the turn and, if determined, which type of balls belong to who
-                if (!player_flag) {
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Add the rectangles covered by the paths of the preview, a few points at a time
+void    add_path_dirty(const struct path *pv)
+{
+int     i, k;   // ball and point indexes
+int     n;      // points of a path
+int     rc;     // radius of the end circle [pixels]
+struct drect r; // rectangle of some points
 
-                    rectfill(screen, 10, 520, x_tc - 10, 520 + 40, BLUE);
-                    rect(screen, 10, 519, x_tc - 10, 520 + 41, WHITE);
-                    textout_centre_ex(screen, font, "PLAYER 1", x_tc/2 , 530, WHITE, - 1);
+        rc = cf * DIAM/2 + 1;
 
-                    if (type_flag == 1) textout_centre_ex(screen, font, "solid", x_tc/2 , 550, WHITE, - 1);
-                    if (type_flag == 2) textout_centre_ex(screen, font, "striped", x_tc/2 , 550, WHITE, - 1);
+        for (i = 0; i < N_BALLS; i++) {
+            n = pv->n[i];
+            if (n < 2) continue;
+
+            r.x0 = 0; r.x1 = - 1;
+            for (k = 0; k < n; k++) {
+                grow_rect(&r, pv->x[i][k], pv->y[i][k]);
+                if (k % 4 == 3 || k == n - 1) { // pieces share their end points
+                    r.x0--; r.y0--; r.x1++; r.y1++;
+                    add_rect(&dirty, r);
+                    r.x0 = 0; r.x1 = - 1;
+                    grow_rect(&r, pv->x[i][k], pv->y[i][k]);
                 }
-                else {
-    
-                    rectfill(screen, 10, 520, x_tc - 10, 520 + 40, RED);
-                    rect(screen, 10, 519, x_tc - 10, 520 + 41, WHITE);
-                    textout_centre_ex(screen, font, "PLAYER 2", x_tc/2, 530, WHITE, - 1);
-
-                    if (type_flag == 2) textout_centre_ex(screen, font, "solid", x_tc/2 , 550, WHITE, - 1);
-                    if (type_flag == 1) textout_centre_ex(screen, font, "striped", x_tc/2 , 550, WHITE, - 1);
+            }
+
+            r.x0 = pv->x[i][n - 1] - rc;
+            r.y0 = pv->y[i][n - 1] - rc;
+            r.x1 = pv->x[i][n - 1] + rc;
+            r.y1 = pv->y[i][n - 1] + rc;
+            add_rect(&dirty, r);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Take the last preview if the preview task is not publishing one, and show it on the path layer while it is the
+// one of the shot aimed from the balls as they are on the table now; the paths shown before and after are marked dirty
+void    update_preview(int aiming)
+{
+static struct path pv;  // last preview taken
+int     show;           // 1 if the preview has to be shown
+
+        if (pthread_mutex_trylock(&pmux) == 0) {
+            if (pv_res.seq != pv.seq) pv = pv_res;
+            pthread_mutex_unlock(&pmux);
+        }
+
+        show = aiming && preview_flag && pv.seq > 0 && pv.theta == theta && pv.v == v && pv.moves == table.moves;
+        if (show && pv_shown.seq == pv.seq) return;     // already shown
+        if (!show && pv_shown.seq == 0) return;         // nothing shown
+
+        add_path_dirty(&pv_shown);
+        clear_to_color(PathLayer, bitmap_mask_color(PathLayer));
+        pv_shown.seq = 0;
+
+        if (show) {
+            pv_shown = pv;
+            draw_paths(&pv_shown);
+            add_path_dirty(&pv_shown);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// DYSPLAY TASK FUNCTIONS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+// Compose the frame of time now [us] in a memory bitmap, redrawing just the table rectangles covered by what moved
+// in this frame or the last one, execute the drawing commands queued by the other tasks on top of it and paste on
+// out, in a single pass, only the parts of the frame that changed
+void    display_frame(BITMAP* out, long now)
+{
+int     i, k;   // ball, rectangle and command indexes
+static float x[SIM_MAX_BALLS], y[SIM_MAX_BALLS]; // copy variables
+struct drect r;         // rectangle covered by a ball in this frame
+struct drect rh, rt;    // rectangles changed at the head and at the tail of a trail
+const struct drect none = {0, 0, -1, -1};
+struct aim   am;        // aim line of this frame
+int     aiming;         // 1 while the player aims the next shot
+char    key[60];        // values shown by a widget
+static struct dcmd cmd[DQ_LEN]; // commands taken from the queue
+int     n_cmd;          // number of commands taken
+static int full = 1;    // redraw the whole table, pending until the game is shown
+static int first = 1;   // first frame, pasted whole
+static struct cbuf fresh[SIM_MAX_BALLS];    // wake points to draw, copied from the ball task
+static char show[SIM_MAX_BALLS];            // trail shown for each ball
+
+        snap_positions(now, x, y);
+
+        // Take the commands queued since the last frame
+        pthread_mutex_lock(&qmux);
+        n_cmd = n_dq;
+        memcpy(cmd, dq, n_cmd * sizeof(cmd[0]));
+        n_dq = 0;
+        pthread_mutex_unlock(&qmux);
+
+        for (k = 0; k < n_cmd; k++) {
+            if (cmd[k].type == CMD_FULL) full = 1;
+        }
+
+        shown.n = 0;
+        if (first) add_rect(&shown, shown.all);
+        first = 0;
+
+        if (show_game) {
+            
+            dirty.n = 0;
+            if (full) { // something was drawn over the table
+                full = 0;
+                add_rect(&dirty, dirty.all);
+            }
+
+            // Table areas drawn over by the other tasks
+            for (k = 0; k < n_cmd; k++) {
+                if (cmd[k].type == CMD_ERASE)
+                    add_area(&dirty, cmd[k].x0 - x_tc, cmd[k].y0 - y_tc, cmd[k].x1 - x_tc, cmd[k].y1 - y_tc);
+            }
+
+            // Balls dirty where they were and where they are, if they moved
+            for (i = 0; i < table.n; i++) {
+                r = ball_rect(i, x[i], y[i]);
+                if (!same_rect(&r, &ball_r[i])) {
+                    add_rect(&dirty, ball_r[i]);
+                    add_rect(&dirty, r);
+                    ball_r[i] = r;
                 }
+            }
+
+            // Trails dirty only where wake points have been added or aged out on the layer; the new points are
+            // copied under the table lock and drawn after it is released
+            pthread_mutex_lock(&mux);
+            for (i = 0; i < table.n; i++) {
+                show[i] = trail_flag && table.active[i];
+                if (show[i]) copy_wake(i, &fresh[i]);
+                else fresh[i].seq = wake[i].seq;
+            }
+            pthread_mutex_unlock(&mux);
 
-                // Show if the ball trail is being displayed or not
-                rectfill(screen, 5, 580, x_tc - 5, 580 + 20, BLACK);
-                rect(screen, 5, 580, x_tc - 5, 580 + 20, WHITE);
-                if (trail_flag) textout_centre_ex(screen, font, "trail = ON", x_tc/2, 587, WHITE, - 1);
-                else            textout_centre_ex(screen, font, "trail = OFF", x_tc/2, 587, WHITE, - 1);
+            for (i = 0; i < table.n; i++) {
+                rh = rt = none;
+                update_trail(i, &fresh[i], show[i], &rh, &rt);
+                add_rect(&dirty, rh);
+                add_rect(&dirty, rt);
             }
 
+            // Display white ball trajectory for shot and shot power indicator
+            memset(&am, 0, sizeof(am));
+            aiming = table.active[0] && cond1[N_BALLS - 1];
+            if (aiming) find_aim(theta, x[0], y[0], x, y, &am);
+            update_preview(aiming);
+            if (memcmp(&am, &aim_prev, sizeof(am)) != 0) {
+                add_aim_dirty(&aim_prev);
+                add_aim_dirty(&am);
+                aim_prev = am;
+            }
+
+            // Redraw just the dirty rectangles of the table on the frame
+            for (k = 0; k < dirty.n; k++) redraw_rect(&dirty.r[k], &am);
+            set_clip_rect(GameTable, 0, 0, XTAB - 1, YTAB - 1);
+
+            // Eliminated balls beside the table (pocketed extra balls are not shown)
+            for (i = 0; i < N_BALLS; i++) {
+                if (!table.active[i]) draw_ball(i, x[i], y[i], ball[i].rle);
+            }
+
+            // HUD widgets, rendered and pasted again only when what they show changes
+            if (aiming) sprintf(key, "%4.2f", v);
+            else        sprintf(key, "hidden");
+            if (widget_changed(&pow_w, key)) {
+                draw_pow_ind(&pow_w, aiming, v);
+                paste_widget(&pow_w);
+            }
+
+            sprintf(key, "%5.3f %4.2f %4.2f", f, dump, T_scale);
+            if (widget_changed(&par_w, key)) {
+                draw_par_ind(&par_w, f, dump, T_scale);
+                paste_widget(&par_w);
+            }
+
+            sprintf(key, "%d %d", player_flag, type_flag);
+            if (widget_changed(&player_w, key)) {
+                draw_player_ind(&player_w, player_flag, type_flag);
+                paste_widget(&player_w);
+            }
+
+            sprintf(key, "%d", trail_flag);
+            if (widget_changed(&trail_w, key)) {
+                draw_trail_ind(&trail_w, trail_flag);
+                paste_widget(&trail_w);
+            }
+        }
+
+        // What the other tasks asked to draw, on top of the game
+        for (k = 0; k < n_cmd; k++) run_cmd(&cmd[k]);
+
+        // Paste the frame on out
+        n_pix = 0;
+        for (k = 0; k < shown.n; k++) {
+            r = shown.r[k];
+            blit(Frame, out, r.x0, r.y0, r.x0, r.y0, r.x1 - r.x0 + 1, r.y1 - r.y0 + 1);
+            n_pix += (long) (r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1);
+        }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Display task, the only one drawing on screen
+void*   display_task(void* arg)
+{
+int     a;      // task index
+long    t0;     // job start time [us]
+
+        a = get_task_index(arg);
+
+        wait_for_activation(a);
+
+        while (!end) {
+
+            t0 = get_systime(MICRO);
+
+            display_frame(screen, get_systime(MICRO));
+            if (cap_fp != NULL) cap_push(Frame);
+
+            task_update_wcet(a, get_systime(MICRO) - t0);
             deadline_miss(a);
 
             wait_for_period(a);
@@ -1544,97 +2644,275 @@ float   x[N_BALLS], y[N_BALLS]; // copy variables
 }
 
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
-// MAIN
+// HUD TASK FUNCTIONS
 /*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
-int main() 
+// Write the i-th line of the task statistics panel in str
+void    hud_line(int i, char* str)
 {
-int     i;          // ball index
-int     a, b;       // parameters for graphic
+int     k;      // first task of the line
 
-char    s0[30];     // ball task deadline misses string
-char    s1[30];     // shot task deadline misses string
-char    s2[30];     // display task deadline misses string
-char    s3[30];     // set param task deadline misses string
-char    s4[30];     // manage task deadline misses string
+        k = 2*(i - 1);
+        if (i == 0)      sprintf(str, "Task deadline misses:");
+        else if (i <= N_TASKS/2) sprintf(str, "%-9s%3d %-9s%3d", task_name[k], task_dmiss(k), task_name[k + 1], task_dmiss(k + 1));
+        else if (i == N_TASKS/2 + 1) sprintf(str, "ball step = %6ld us, max = %6ld us, substeps = %2d", task_et(0), task_wcet(0), nsub);
+        else             sprintf(str, "display frame = %6ld us, max = %6ld us, %6ld px", task_et(2), task_wcet(2), n_pix);
+}
 
-        init();     // initialize game
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Queue the help text once, then each line of the task statistics panel only when it changes
+void*   hud_task(void* arg)
+{
+int     a;                  // task index
+int     i;                  // line index
+char    str[60];            // line now
+char    last[N_HUD][60];    // line as last queued
+long    t0;                 // job start time [us]
+const int hx[N_HUD] = {790, 790, 790, 790, 790, 240, 240};     // line positions [pixels]
+const int hy[N_HUD] = {613, 633, 653, 673, 693, 653, 709};
 
-        // Initialize semaphore
-        pthread_mutex_init(&mux, NULL);
+        a = get_task_index(arg);
 
-        // Create tasks
-        task_create(ball_task, 0, PER, PER, 90, ACT);
+        wait_for_activation(a);
 
-        task_create(shot_task, 1, 20, 20, 70, ACT);
-            
-        task_create(display_task, 2, 50, 50, 50, ACT);
+        cmd_shape(CMD_RECT, 10, 10, XWIN - 10, y_tc - 10, WHITE);
 
-        task_create(set_param_task, 3, 20, 20, 60, ACT);
+        cmd_text(
+        "SHOT: Move the mouse while pressing the wheel to direct, left button to increase power, right to decrease, SPACE to shoot",
+        30, 30, WHITE, - 1, 0);
 
-        task_create(manage_task, 4, 200, 200, 80, ACT);
+        cmd_text(
+        "- If a foul occurs move the mouse on the field to move the ball on the field and press TAB to position",
+        30, 55, WHITE, - 1, 0);
 
-        while (!key[KEY_ESC]) { // Press esc to exit
-            
-            rect(screen, 10, 10, XWIN - 10, y_tc - 10, WHITE);
+        cmd_text(
+        "- Before a shot for the win change the declared hole with LEFT or RIGHT arrow and choose one with ENTER",
+        30, 80, WHITE, - 1, 0);
+
+        cmd_text(
+        "- Press T to activate or deactivate balls trail display, V the preview of the whole shot",
+        30, 105, WHITE, - 1, 0);
+
+        cmd_text(
+        "- Press ESC in any moment to turn the game off",
+        30, 130, WHITE, - 1, 0);
 
-            textout_ex(screen, font,
-            "SHOT: Move the mouse while pressing the wheel to direct, left button to increase power, right to decrease, SPACE to shoot",
-            30, 30, WHITE, - 1);
+        cmd_text(
+        "Press Q to increase friction, A to decrease",
+        240, 633, WHITE, - 1, 0);
 
-            textout_ex(screen, font,
-            "- If a foul occurs move the mouse on the field to move the ball on the field and press TAB to position",
-            30, 55, WHITE, - 1);
+        cmd_text(
+        "Press W to increase dumping factor (- loss), S to decrease (+ loss)",
+        240, 633 + 56, WHITE, - 1, 0);
 
-            textout_ex(screen, font,
-            "- Before a shot for the win change the declared hole with LEFT or RIGHT arrow and choose one with ENTER",
-            30, 80, WHITE, - 1);
+        cmd_text(
+        "Press E to increase time scale factor, D to decrease",
+        240, 633 + 56 + 56, WHITE, - 1, 0);
 
-            textout_ex(screen, font,
-            "- Press T to activate or deactivate balls trail display",
-            30, 105, WHITE, - 1);
+        for (i = 0; i < N_HUD; i++) last[i][0] = 0;
 
-            textout_ex(screen, font,
-            "- Press ESC in any moment to turn the game off",
-            30, 130, WHITE, - 1);
+        while (!end) {
 
-            sprintf(s0, "ball task = %3.1d", task_dmiss(0));
-            sprintf(s1, "shot task = %3.1d", task_dmiss(1));
-            sprintf(s2, "display task = %3.1d", task_dmiss(2));
-            sprintf(s3, "set param task = %3.1d", task_dmiss(3));
-            sprintf(s4, "manage task = %3.1d", task_dmiss(4));
+            t0 = get_systime(MICRO);
 
-            a = 820;
-            b = 613;
+            for (i = 0; i < N_HUD; i++) {
+                hud_line(i, str);
+                if (strcmp(str, last[i]) != 0) {
+                    strcpy(last[i], str);
+                    cmd_text(str, hx[i], hy[i], RED, YELLOW, 0);
+                }
+            }
 
-            textout_ex(screen, font, "Task deadline misses:", a, b, RED, YELLOW);
-            textout_ex(screen, font, s0, a, b + 20, RED, YELLOW);
-            textout_ex(screen, font, s1, a, b + 40, RED, YELLOW);
-            textout_ex(screen, font, s2, a, b + 60, RED, YELLOW);
-            textout_ex(screen, font, s3, a, b + 80, RED, YELLOW);
-            textout_ex(screen, font, s4, a, b + 100, RED, YELLOW);
+            task_update_wcet(a, get_systime(MICRO) - t0);
+            deadline_miss(a);
 
-            textout_ex(screen, font,
-            "Press Q to increase friction, A to decrease",
-            240, 633, WHITE, - 1);
+            wait_for_period(a);
+        }
 
-            textout_ex(screen, font,
-            "Press W to increase dumping factor (- loss), S to decrease (+ loss)",
-            240, 633 + 56, WHITE, - 1);
+        return NULL;
+}
 
-            textout_ex(screen, font,
-            "Press E to increase time scale factor, D to decrease",
-            240, 633 + 56 + 56, WHITE, - 1);
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// HEADLESS BENCHMARK
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
+// Write the bitmap bm in the binary PPM file name
+void    save_ppm(BITMAP* bm, const char* name)
+{
+FILE*   fp;     // PPM file
+int     x, y;   // pixel coordinates
+int     c;      // pixel color
+
+        fp = fopen(name, "wb");
+        if (fp == NULL) return;
+
+        fprintf(fp, "P6\n%d %d\n255\n", bm->w, bm->h);
+        for (y = 0; y < bm->h; y++) {
+            for (x = 0; x < bm->w; x++) {
+                c = getpixel(bm, x, y);
+                fputc(getr(c), fp);
+                fputc(getg(c), fp);
+                fputc(getb(c), fp);
+            }
         }
+        fclose(fp);
+}
 
-        // Free memory and cleanup
-        destroy_bitmap(GameTable);
-        for (i = 0; i < N_BALLS; i++) {
-            if (ball[i].bm) {
-                destroy_bitmap(ball[i].bm);
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Render frames without a window, as the display task would, while the balls are racked, aimed for BENCH_AIM
+// frames with the aim line turning and broken with trails on, over and over; the physics advances one ball task
+// period per frame. Print the execution time and the pixels pasted of every frame, then their mean and maximum;
+// with a prefix every frame is also dumped as prefixNNNNN.ppm
+void    bench(int frames, const char* dump)
+{
+int     k;              // frame index
+int     aim = 0;        // frames spent aiming the current shot
+long    t0, t;          // frame start and execution time [us]
+long    sum = 0;        // total execution time [us]
+long    max = 0;        // maximum execution time [us]
+long    pix = 0;        // total pixels pasted
+char    name[256];      // dumped frame file name
+BITMAP* out;            // stands for the screen
+
+        out = create_bitmap(XWIN, YWIN);
+        clear_to_color(out, BLACK);
+
+        trail_flag = 1;
+        cond1[N_BALLS - 1] = 1;
+
+        printf("# frame time[us] pixels\n");
+
+        for (k = 0; k < frames; k++) {
+
+            if (cond1[N_BALLS - 1]) {
+                theta += 0.01;
+                if (++aim == BENCH_AIM) { // shoot
+                    sim_shoot(&table, theta, v);
+                    cond1[N_BALLS - 1] = 0;
+                    aim = 0;
+                }
+            }
+            else {
+                ball_step(T_scale * PER / 1000.0);
+                if (sim_at_rest(&table, 1e-3)) { // rack again for the next break
+                    init_balls();
+                    cond1[N_BALLS - 1] = 1;
+                }
+            }
+
+            t0 = get_systime(MICRO);
+            display_frame(out, LONG_MAX);   // always the last physics state
+            t = get_systime(MICRO) - t0;
+
+            sum += t;
+            if (t > max) max = t;
+            pix += n_pix;
+            printf("%5d %6ld %7ld\n", k, t, n_pix);
+
+            if (dump != NULL) {
+                snprintf(name, sizeof(name), "%s%05d.ppm", dump, k);
+                save_ppm(out, name);
             }
         }
-        allegro_exit();
+
+        printf("# %d frames: mean = %ld us, max = %ld us, mean pixels = %ld\n", frames, sum / frames, max, pix / frames);
+
+        destroy_bitmap(out);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// MAIN
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+int     i;                  // ball index
+int     opt;                // command line option
+int     frames = 0;         // frames of the headless benchmark, 0 to play
+const char* dump = NULL;    // file name prefix of the frames dumped by the benchmark
+const char* capture = NULL; // capture file name
+
+        // Stress mode: ./PoolGame -b 500 plays with 500 balls on a table large enough for them
+        // Headless benchmark: ./PoolGame -r 300 [-o frame] renders 300 frames without a window
+        // Capture: ./PoolGame -c match.ppm records one frame every CAP_EVERY of the game
+        while ((opt = getopt(argc, argv, "b:r:o:c:")) != -1) {
+            if (opt == 'b') n_balls = atoi(optarg);
+            if (opt == 'r') frames = atoi(optarg);
+            if (opt == 'o') dump = optarg;
+            if (opt == 'c') capture = optarg;
+            if ((opt != 'b' && opt != 'r' && opt != 'o' && opt != 'c') || n_balls < N_BALLS || n_balls > SIM_MAX_BALLS || frames < 0) {
+                fprintf(stderr, "usage: %s [-b balls, from %d to %d] [-r frames [-o ppm prefix]] [-c capture file]\n",
+                        argv[0], N_BALLS, SIM_MAX_BALLS);
+                return 1;
+            }
+        }
+
+        init(frames == 0);  // initialize game
+
+        if (capture != NULL && cap_open(capture, Frame) != 0) {
+            fprintf(stderr, "cannot capture %d bit frames to %s\n", bitmap_color_depth(Frame), capture);
+            close_game();
+            return 1;
+        }
+
+        // Initialize semaphore, with priority inheritance: the preview task copies the table under it
+        pthread_mutexattr_init(&matt);
+        pthread_mutexattr_setprotocol(&matt, PTHREAD_PRIO_INHERIT);
+        pthread_mutex_init(&mux, &matt);
+
+        if (frames > 0) {
+            bench(frames, dump);
+            close_game();
+            return 0;
+        }
+
+        // Create tasks
+        task_create(ball_task, 0, PER, PER, 90, ACT);
+
+        task_create(shot_task, 1, 20, 20, 70, ACT);
+            
+        task_create(display_task, 2, DISP_PER, DISP_PER, 50, ACT);
+
+        task_create(set_param_task, 3, 20, 20, 60, ACT);
+
+        task_create(manage_task, 4, 200, 200, 80, ACT);
+
+        task_create(hud_task, 5, HUD_PER, HUD_PER, 40, ACT);
+
+        if (cap_fp != NULL) task_create(capture_task, CAP_TASK, CAP_PER, CAP_PER, 30, ACT);
+
+        task_create(preview_task, PREV_TASK, PREV_PER, PREV_PER, 20, ACT);
+
+        // Sleep until ESC is pressed
+        pthread_mutex_lock(&quit_mux);
+        while (!quit) pthread_cond_wait(&quit_cond, &quit_mux);
+        pthread_mutex_unlock(&quit_mux);
+
+        // Stop every task before Allegro goes, they read the input and queue drawing commands
+        end = 1;
+        wait_for_task_end(0);
+        wait_for_task_end(1);
+        wait_for_task_end(2);
+        wait_for_task_end(3);
+        wait_for_task_end(4);
+        wait_for_task_end(5);
+        wait_for_task_end(PREV_TASK);
+        if (cap_fp != NULL) {
+            wait_for_task_end(CAP_TASK);
+            cap_close();
+        }
+
+        // Free memory and cleanup
+        close_game();
+
+        // Timing report, to find the scaling limits of the tasks in stress mode
+        if (n_balls > N_BALLS) {
+            printf("%d balls, table %.2f x %.2f m\n", n_balls, table.table.lx, table.table.ly);
+            for (i = 0; i < N_TASKS; i++) if (i != CAP_TASK || cap_fp != NULL)
+                printf("%-9s task: mean = %6ld us, max = %6ld us, deadline misses = %d\n",
+                       task_name[i], task_mean_et(i), task_wcet(i), task_dmiss(i));
+            printf("drawing commands dropped = %d\n", n_drop);
+        }
+
         return 0;
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+//                                                                     HEADLESS POOL SIMULATOR
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Plays random break shots with the table physics and no display, as fast as possible.
+// Usage: ./PoolSim [-n number of shots] [-s random seed] [-e (event-driven engine)]
+//                  [-t table width x height in metres, e.g. 2.54x1.27]
+//                  [-d (bit-reproducible mode, prints the hash of the whole run)]
+//                  [-c (contact solver)] [-b balls packed on the whole table] [-j solver threads]
+//                  [-a time scale (steps of DT times the scale, split in substeps as the speed requires)]
+//                  [-r candidate shots ranked after each shot] [-k candidates played again by the full engine]
+//                  [-w tables simulated together (shots played in batches by the vector kernel)]
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+// Table physics library
+#include "physics.h"
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// CONSTANTS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+#define     N_SHOTS     10000       // default number of simulated shots
+#define     N_BALLS     16          // default number of balls, cue ball included
+#define     DT          0.04        // integration step, same as ball task at time scale 1 [s]
+#define     THRES       1e-3        // velocity threshold for the table at rest [m/s]
+#define     MAX_STEPS   10000       // steps after which a shot is stopped anyway
+#define     V_MAX       2           // maximum shot velocity [m/s]
+#define     F0          0.02        // table friction factor (speed lost every SIM_T_REF)
+#define     DUMP0       0.9         // bounds bouncing dumping factor
+#define     TOP_K       8           // default number of candidates played by the full engine
+#define     MAX_CAND    100000      // maximum number of candidate shots
+#define     MAX_TABLES  1024        // maximum number of tables simulated together
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// FUNCTIONS DEFINITIONS
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+// Return a random number in [lo, hi]
+float   frand(float lo, float hi)
+{
+        return lo + (hi - lo) * ((float) rand() / RAND_MAX);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Return the elapsed time since t0 [s]
+double  elapsed(struct timespec t0)
+{
+struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (t.tv_sec - t0.tv_sec) + (t.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// Pack the balls in hexagonal rows from the upper left corner of the table, almost
+// in contact, for the stress tests; returns 0 if they do not fit
+int     pack_balls(struct sim_state *s)
+{
+float   d = 0.999 * DIAM;   // distance between neighbours, slightly overlapping
+int     i, row = 0;         // ball and row indexes
+float   x = DIAM, y = DIAM; // position of the next ball [m]
+
+        sim_rack(s);
+
+        for (i = 0; i < s->n; i++) {
+
+            if (x > s->table.lx - DIAM) {
+                row++;
+                x = DIAM + (row % 2) * d/2;
+                y += d * sqrt(3) / 2;
+            }
+            if (y > s->table.ly - DIAM) return 0;
+
+            sim_place(s, i, x, y);
+            x += d;
+        }
+        return 1;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+// MAIN
+/*--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+static struct sim_state s;      // simulated table
+static struct sim_state work;   // copy of the table for the shot search
+static struct sim_shot cand[MAX_CAND];  // candidate shots
+static struct sim_shot shot[MAX_TABLES];  // shots of a batch
+struct sim_state    *table[MAX_TABLES]; // tables of a batch
+int     n_tables = 0;           // tables simulated together (0 = one shot at a time)
+int     b;                      // table index in a batch
+struct timespec     t0;         // benchmark start time
+int     n_shots = N_SHOTS;      // number of shots to simulate
+int     mode = SIM_STEPPED;     // physics engine mode
+int     exact = 0;              // bit-reproducible mode
+int     solver = 0;             // contact solver
+int     n_balls = N_BALLS;      // number of balls on the table
+int     n_threads = 1;          // threads solving the contacts
+float   scale = 0;              // time scale of the adaptive steps (0 = plain fixed steps)
+int     n_cand = 0;             // candidate shots ranked after each shot (0 = no shot search)
+int     top_k = TOP_K;          // candidates played again by the full engine
+double  t_coarse = 0;           // time spent in the coarse rollouts [s]
+double  t_rank = 0;             // time spent ranking, coarse rollouts and full engine [s]
+double  best = 0;               // sum of the scores of the best candidates
+int     n_search = 0;           // number of shot searches done
+struct timespec     t1;         // shot search start time
+int     c;                      // candidate index
+int     st;                     // step index
+long    substeps = 0;           // total number of substeps
+int     opt;                    // command line option
+float   lx = LX, ly = LY;       // table size [m]
+int     k;                      // shot index
+long    steps = 0;              // total number of physics steps
+long    pocketed = 0;           // total number of pocketed balls
+unsigned hash = SIM_HASH0;      // hash of every shot (exact mode)
+float   theta, v;               // shot direction [rad] and velocity [m/s]
+double  t;                      // benchmark duration [s]
+
+        srand(1);
+
+        while ((opt = getopt(argc, argv, "n:s:et:dcb:j:a:r:k:w:")) != -1) {
+            switch (opt) {
+                case 'n': n_shots = atoi(optarg); break;
+                case 's': srand(atoi(optarg)); break;
+                case 'e': mode = SIM_EVENTS; break;
+                case 'd': exact = 1; break;
+                case 'c': solver = 1; break;
+                case 'b': n_balls = atoi(optarg); break;
+                case 'j': n_threads = atoi(optarg); break;
+                case 'a': scale = atof(optarg); break;
+                case 'r': n_cand = atoi(optarg); break;
+                case 'k': top_k = atoi(optarg); break;
+                case 'w': n_tables = atoi(optarg); break;
+                case 't':
+                    if (sscanf(optarg, "%fx%f", &lx, &ly) == 2 && lx > 0.5 && ly > 0.5) break;
+                    fprintf(stderr, "%s: table size must be like 2.54x1.27 (at least 0.5 m)\n", argv[0]);
+                    return 1;
+                default:
+                    fprintf(stderr, "usage: %s [-n shots] [-s seed] [-e] [-t WxH] [-d] [-c] [-b balls] [-j threads] [-a scale] [-r candidates] [-k top] [-w tables]\n", argv[0]);
+                    return 1;
+            }
+        }
+
+        if (n_cand < 0 || n_cand > MAX_CAND) {
+            fprintf(stderr, "%s: from 0 to %d candidate shots\n", argv[0], MAX_CAND);
+            return 1;
+        }
+
+        if (n_tables < 0 || n_tables > MAX_TABLES) {
+            fprintf(stderr, "%s: from 0 to %d tables\n", argv[0], MAX_TABLES);
+            return 1;
+        }
+
+        if (n_balls < 1 || n_balls > SIM_MAX_BALLS) {
+            fprintf(stderr, "%s: from 1 to %d balls\n", argv[0], SIM_MAX_BALLS);
+            return 1;
+        }
+
+        sim_init(&s, n_balls, F0, DUMP0);
+        s.mode = mode;
+        s.exact = exact;
+        s.solver = solver;
+        sim_set_table(&s, lx, ly, HC, HP);
+        n_threads = sim_set_threads(&s, n_threads);
+
+        if (n_balls > N_BALLS && !pack_balls(&s)) {
+            fprintf(stderr, "%s: %d balls do not fit on the table, try a larger one with -t\n", argv[0], n_balls);
+            return 1;
+        }
+
+        // every table of a batch starts as a copy of s, aligned as its ball arrays
+        for (b = 0; b < n_tables; b++) {
+            if (posix_memalign((void **) &table[b], 32, sizeof(struct sim_state)) != 0) {
+                fprintf(stderr, "%s: not enough memory for %d tables\n", argv[0], n_tables);
+                while (b > 0) free(table[--b]);
+                return 1;
+            }
+            *table[b] = s;
+            table[b]->pool.n = 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        // shots played in batches of n_tables tables
+        for (k = 0; k < n_shots && n_tables > 0; k += b) {
+
+            for (b = 0; b < n_tables && k + b < n_shots; b++) {
+                if (n_balls > N_BALLS) pack_balls(table[b]);
+                else sim_rack(table[b]);
+                shot[b].v = frand(0.1 * V_MAX, V_MAX);     // same draws, in the same order, as the loop below
+                shot[b].theta = frand(-M_PI, M_PI);
+            }
+
+            steps += sim_simulate_batch(table, shot, b, DT, MAX_STEPS);
+
+            for (b = 0; b < n_tables && k + b < n_shots; b++) {
+                pocketed += table[b]->npocket;
+                hash = sim_hash(table[b], hash ^ table[b]->hash);
+            }
+        }
+
+        for (k = 0; k < n_shots && n_tables == 0; k++) {
+
+            if (n_balls > N_BALLS) pack_balls(&s);
+            else sim_rack(&s);
+            v = frand(0.1 * V_MAX, V_MAX);     // velocity first, as in the batches
+            theta = frand(-M_PI, M_PI);
+            sim_shoot(&s, theta, v);
+
+            if (scale > 0) {
+                for (st = 0; st < MAX_STEPS && !sim_at_rest(&s, THRES); st++)
+                    substeps += sim_advance(&s, DT * scale);
+                steps += st;
+            }
+            else steps += sim_run_until_rest(&s, DT, THRES, MAX_STEPS);
+            pocketed += s.npocket;
+            hash = sim_hash(&s, hash ^ s.hash);
+
+            // rank random candidates for the next shot from where the balls stopped
+            if (n_cand > 0 && s.active[SIM_CUE]) {
+
+                for (c = 0; c < n_cand; c++) {
+                    cand[c].theta = frand(-M_PI, M_PI);
+                    cand[c].v = frand(0.1 * V_MAX, V_MAX);
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                sim_rank_shots(&s, &work, cand, n_cand, 0, NULL);
+                t_coarse += elapsed(t1);
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                sim_rank_shots(&s, &work, cand, n_cand, top_k, NULL);
+                t_rank += elapsed(t1);
+
+                best += cand[0].score;
+                n_search++;
+            }
+        }
+
+        t = elapsed(t0);
+
+        printf("engine           = %s%s\n", exact ? "fixed step, bit-reproducible" :
+                                            (mode == SIM_EVENTS) ? "event-driven" : "fixed step",
+                                            (solver && (exact || mode != SIM_EVENTS)) ? ", contact solver" : "");
+        printf("table            = %.2f x %.2f m, %d balls\n", lx, ly, n_balls);
+        if (solver) printf("solver threads   = %d\n", n_threads);
+        if (n_tables > 0) printf("batched tables   = %d\n", n_tables);
+        printf("shots            = %d\n", n_shots);
+        printf("physics steps    = %ld (%.1f per shot)\n", steps, (double) steps / n_shots);
+        if (scale > 0) printf("substeps         = %ld (%.2f per step, time scale %g)\n", substeps, (double) substeps / steps, scale);
+        printf("pocketed balls   = %ld (%.2f per shot)\n", pocketed, (double) pocketed / n_shots);
+        printf("elapsed time     = %.3f s\n", t);
+        printf("shots per second = %.0f\n", n_shots / t);
+        printf("steps per second = %.0f\n", steps / t);
+        if (exact) printf("state hash       = %08x\n", hash);
+        if (n_search > 0 && t_rank > t_coarse) {
+            printf("coarse rollouts  = %.1f per ms\n", (double) n_cand * n_search / t_coarse / 1000);
+            printf("full rollouts    = %.2f per ms\n", (double) top_k * n_search / (t_rank - t_coarse) / 1000);
+            printf("ranked shots     = %.1f per ms (best %d played again), mean best score %.2f\n",
+                   (double) n_cand * n_search / t_rank / 1000, top_k, best / n_search);
+        }
+
+        sim_set_threads(&s, 1);
+        for (b = 0; b < n_tables; b++) free(table[b]);
+
+        return 0;
+}
@@ -0,0 +1,2369 @@
+//---------------------------------------------------------------------------------
+//          PHYSICS LIBRARY
+//---------------------------------------------------------------------------------
+// Table simulation without any graphics or task dependency: the game drives it
+// from ball_task, the headless simulator drives it as fast as the CPU allows.
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "physics.h"
+
+// SIMD width of the kernels (floats per vector register), it only depends on
+// the flags physics.c is compiled with
+#if defined(__AVX__)
+#define     SIM_LANES       8
+#elif defined(__SSE__)
+#define     SIM_LANES       4
+#else
+#define     SIM_LANES       1
+#endif
+
+#if SIM_LANES > 1
+#include <immintrin.h>
+#endif
+
+//---------------------------------------------------------------------------------
+// BREAK FORMATION
+
+#define     RACK_BALLS      16      // cue ball and the 15 balls of the triangle
+
+// Ball position in the triangle in units of (a, r), see sim_rack()
+static const int rack_col[RACK_BALLS] = {0, 0, 1, 2, 3,  4, 4,  3, 2,  1,  2,  3, 4,  4, 3, 4};
+static const int rack_row[RACK_BALLS] = {0, 0, 1, 2, 3, -4, 0, -1, 0, -1, -2, -3, 4, -2, 1, 2};
+
+//---------------------------------------------------------------------------------
+// SIMD KERNELS
+//---------------------------------------------------------------------------------
+// Each kernel works on SIM_LANES consecutive balls; pocketed balls and the
+// padding after n have zero velocity, so they need no masking when integrated.
+
+#if SIM_LANES == 8
+typedef __m256  vfloat;
+#define     VLOAD(p)        _mm256_load_ps(p)
+#define     VSTORE(p, a)    _mm256_store_ps(p, a)
+#define     VSET(a)         _mm256_set1_ps(a)
+#define     VADD(a, b)      _mm256_add_ps(a, b)
+#define     VSUB(a, b)      _mm256_sub_ps(a, b)
+#define     VMUL(a, b)      _mm256_mul_ps(a, b)
+#define     VLT(a, b)       _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define     VMASK(a)        _mm256_movemask_ps(a)
+#define     VDIV(a, b)      _mm256_div_ps(a, b)
+#define     VSQRT(a)        _mm256_sqrt_ps(a)
+#define     VAND(a, b)      _mm256_and_ps(a, b)
+#define     VOR(a, b)       _mm256_or_ps(a, b)
+#define     VANDN(a, b)     _mm256_andnot_ps(a, b)
+#elif SIM_LANES == 4
+typedef __m128  vfloat;
+#define     VLOAD(p)        _mm_load_ps(p)
+#define     VSTORE(p, a)    _mm_store_ps(p, a)
+#define     VSET(a)         _mm_set1_ps(a)
+#define     VADD(a, b)      _mm_add_ps(a, b)
+#define     VSUB(a, b)      _mm_sub_ps(a, b)
+#define     VMUL(a, b)      _mm_mul_ps(a, b)
+#define     VLT(a, b)       _mm_cmplt_ps(a, b)
+#define     VMASK(a)        _mm_movemask_ps(a)
+#define     VDIV(a, b)      _mm_div_ps(a, b)
+#define     VSQRT(a)        _mm_sqrt_ps(a)
+#define     VAND(a, b)      _mm_and_ps(a, b)
+#define     VOR(a, b)       _mm_or_ps(a, b)
+#define     VANDN(a, b)     _mm_andnot_ps(a, b)
+#endif
+
+#if SIM_LANES > 1
+#define     VSEL(m, a, b)   VOR(VAND(m, a), VANDN(m, b))    // a where the mask m is set, else b
+#define     VABS(a)         VANDN(VSET(-0.0f), a)
+#endif
+
+#define     N_BLOCKS(n)     (((n) + SIM_LANES - 1) / SIM_LANES)     // blocks of SIM_LANES balls
+
+//---------------------------------------------------------------------------------
+// UPDATE_STATUS(s, S, decay):
+// moves the awake balls by the travelled length S [m s] of a step and applies its
+// friction decay; the vector kernel runs over the whole table (sleeping balls
+// have zero velocity) once most balls are awake
+static void update_status(struct sim_state *s, float S, float decay)
+{
+int     i, k;
+#if SIM_LANES > 1
+vfloat  vS = VSET(S);
+vfloat  vdecay = VSET(decay);
+vfloat  vx, vy;
+
+        if (2 * s->n_awake > s->n) {
+
+            for (i = 0; i < N_BLOCKS(s->n) * SIM_LANES; i += SIM_LANES) {
+
+                vx = VLOAD(&s->vx[i]);
+                vy = VLOAD(&s->vy[i]);
+
+                // Exact integration of the position under friction
+                VSTORE(&s->x[i], VADD(VLOAD(&s->x[i]), VMUL(vx, vS)));
+                VSTORE(&s->y[i], VADD(VLOAD(&s->y[i]), VMUL(vy, vS)));
+
+                // Apply friction decay
+                VSTORE(&s->vx[i], VMUL(vx, vdecay));
+                VSTORE(&s->vy[i], VMUL(vy, vdecay));
+            }
+            return;
+        }
+#endif
+        for (k = 0; k < s->n_awake; k++) {
+
+            i = s->wake_list[k];
+
+            // Exact integration of the position under friction
+            s->x[i] += s->vx[i] * S;
+            s->y[i] += s->vy[i] * S;
+
+            // Apply friction decay
+            s->vx[i] *= decay;
+            s->vy[i] *= decay;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// OVERLAP_MASK(s, i, j0):
+// returns a bit mask of the balls j0 ... j0 + SIM_LANES - 1 that are closer
+// than DIAM to the i-th ball (j0 multiple of SIM_LANES)
+static unsigned overlap_mask(const struct sim_state *s, int i, int j0)
+{
+unsigned m = 0;
+#if SIM_LANES > 1
+vfloat  dx, dy;
+
+        dx = VSUB(VLOAD(&s->x[j0]), VSET(s->x[i]));
+        dy = VSUB(VLOAD(&s->y[j0]), VSET(s->y[i]));
+        m = VMASK(VLT(VADD(VMUL(dx, dx), VMUL(dy, dy)), VSET(DIAM*DIAM)));
+#else
+float   dx, dy;
+
+        dx = s->x[j0] - s->x[i];
+        dy = s->y[j0] - s->y[i];
+        m = (dx*dx + dy*dy < (float) (DIAM*DIAM));
+#endif
+        return m;
+}
+
+//---------------------------------------------------------------------------------
+// INTERNAL FUNCTIONS
+//---------------------------------------------------------------------------------
+
+//---------------------------------------------------------------------------------
+// WAKE_BALL(s, i):
+// adds the i-th ball to the awake list, keeping it sorted by index
+static void wake_ball(struct sim_state *s, int i)
+{
+int     k;  // position in the awake list
+
+        if (s->awake[i] || !s->active[i]) return;
+
+        for (k = s->n_awake; k > 0 && s->wake_list[k - 1] > i; k--)
+            s->wake_list[k] = s->wake_list[k - 1];
+
+        s->wake_list[k] = i;
+        s->n_awake++;
+        s->awake[i] = 1;
+        s->rest_dirty = 1;
+}
+
+//---------------------------------------------------------------------------------
+// SLEEP_BALL(s, i):
+// stops the i-th ball and removes it from the awake list
+static void sleep_ball(struct sim_state *s, int i)
+{
+int     k;  // position in the awake list
+
+        s->vx[i] = 0;
+        s->vy[i] = 0;
+
+        if (!s->awake[i]) return;
+
+        for (k = 0; s->wake_list[k] != i; k++);
+        for (; k < s->n_awake - 1; k++)
+            s->wake_list[k] = s->wake_list[k + 1];
+
+        s->n_awake--;
+        s->awake[i] = 0;
+        s->rest_dirty = 1;
+}
+
+//---------------------------------------------------------------------------------
+// SLEEP_STILL(s):
+// puts to sleep the awake balls slower than the threshold
+static void sleep_still(struct sim_state *s)
+{
+int     k, i;
+
+        // backwards, so removing a ball does not skip the next one
+        for (k = s->n_awake - 1; k >= 0; k--) {
+            i = s->wake_list[k];
+            if (fabs(s->vx[i]) < s->thres && fabs(s->vy[i]) < s->thres) sleep_ball(s, i);
+        }
+}
+
+//---------------------------------------------------------------------------------
+// IN_FIELD(s, i):
+// returns 1 if the i-th ball is inside the cushion band, too far from the bounds
+// to touch any cushion or hole
+static int in_field(const struct sim_state *s, int i)
+{
+        return s->x[i] > s->band_x0 && s->x[i] < s->band_x1 &&
+               s->y[i] > s->band_y0 && s->y[i] < s->band_y1;
+}
+
+//---------------------------------------------------------------------------------
+// HIT_WALL(s, i, j):
+// bounce of the i-th ball on the j-th cushion considering the dumping factor:
+// straight cushions damp the normal velocity, tunnel walls the whole velocity
+static void hit_wall(struct sim_state *s, int i, int j)
+{
+const struct sim_wall *w = &s->wall[j];
+float   vn;     // velocity along the cushion normal
+float   pen;    // penetration beyond the cushion line [m]
+
+        // put the centre back on the line
+        pen = w->nx * s->x[i] + w->ny * s->y[i] - w->c;
+        if (pen > 0) {
+            s->x[i] -= pen * w->nx;
+            s->y[i] -= pen * w->ny;
+        }
+
+        vn = w->nx * s->vx[i] + w->ny * s->vy[i];
+        if (vn <= 0) return;    // already leaving the cushion
+
+        if (w->rail) {
+            s->vx[i] -= (1 + s->dump) * vn * w->nx;
+            s->vy[i] -= (1 + s->dump) * vn * w->ny;
+            s->nbounce++;
+        }
+        else {
+            s->vx[i] = s->dump * (s->vx[i] - 2 * vn * w->nx);
+            s->vy[i] = s->dump * (s->vy[i] - 2 * vn * w->ny);
+        }
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_BOUNCE(s, i):
+// bounces of the i-th ball on the cushions it went beyond during the last step
+static void handle_bounce(struct sim_state *s, int i)
+{
+const struct sim_wall *w;
+int     j;      // cushion index
+
+        if (in_field(s, i)) return;
+
+        for (j = 0; j < SIM_N_WALLS; j++) {
+
+            w = &s->wall[j];
+            if (w->nx * s->x[i] + w->ny * s->y[i] <= w->c) continue;
+            if (s->x[i] < w->x0 || s->x[i] > w->x1 || s->y[i] < w->y0 || s->y[i] > w->y1) continue;
+
+            hit_wall(s, i, j);
+        }
+}
+
+//---------------------------------------------------------------------------------
+// POCKET_BALL(s, i, j):
+// deactivates the i-th ball that fell in the j-th hole and records the event;
+// pocketed balls are parked outside the field, the cue ball stays where it dropped
+static void pocket_ball(struct sim_state *s, int i, int j)
+{
+
+        sleep_ball(s, i);
+        s->active[i] = 0;
+        if (i != SIM_CUE) {
+            s->x[i] = s->xo[i];
+            s->y[i] = s->yo[i];
+        }
+
+        s->pocket[s->npocket].ball = i;
+        s->pocket[s->npocket].hole = j;
+        s->npocket++;
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_HOLES(s):
+// pockets the awake balls whose centre is inside a hole
+static void handle_holes(struct sim_state *s)
+{
+int     k;          // position in the awake list
+int     i, j;       // ball and hole indexes
+float   dx, dy;     // distance components between ball and hole centres
+
+        // backwards, so pocketing a ball does not skip the next one
+        for (k = s->n_awake - 1; k >= 0; k--) {
+
+            i = s->wake_list[k];
+            if (in_field(s, i)) continue;
+
+            for (j = 0; j < N_HOLES; j++) {
+
+                dx = s->x[i] - s->hole[j].x;
+                dy = s->y[i] - s->hole[j].y;
+
+                if (dx*dx + dy*dy < s->hp2) { // if a ball ends up in a hole
+                    pocket_ball(s, i, j);
+                    break;
+                }
+            }
+        }
+}
+
+//---------------------------------------------------------------------------------
+// BOUNCE(dump, nx, ny, vxi, vyi, vxj, vyj):
+// velocities after a partially anelastic collision between two balls,
+// (nx, ny) is the normal versor pointing from the j-th to the i-th ball
+static void bounce(float dump, float nx, float ny, float *vxi, float *vyi, float *vxj, float *vyj)
+{
+float   tx, ty;             // tangent versor components
+float   vni, vti;           // velocity module on normal and tangential direction of i-th ball before collision
+float   vnj, vtj;           // velocity module on normal and tangential direction of j-th ball before collision
+float   vni_new, vnj_new;   // normal velocities after collision
+float   A;                  // this element prevents to do a square root of a negative number
+
+        tx = - ny;
+        ty = nx;
+
+        vni = *vxi * nx + *vyi * ny;
+        vnj = *vxj * nx + *vyj * ny;
+
+        vti = *vxi * tx + *vyi * ty;
+        vtj = *vxj * tx + *vyj * ty;
+
+        if ((2*dump*dump - 1)*(vni*vni + vnj*vnj) - 2*vni*vnj > 0) {
+            A = 0.5*sqrt((2*dump*dump - 1)*(vni*vni + vnj*vnj) - 2*vni*vnj);
+        }
+        else A = 0;
+
+        vni_new = 0.5*(vni + vnj) + A;
+        vnj_new = 0.5*(vni + vnj) - A;
+
+        *vxi = vni_new * nx + vti * tx;
+        *vyi = vni_new * ny + vti * ty;
+
+        *vxj = vnj_new * nx + vtj * tx;
+        *vyj = vnj_new * ny + vtj * ty;
+}
+
+//---------------------------------------------------------------------------------
+// COLLIDE_PAIR(s, i, j, nx, ny):
+// partially anelastic collision between the i-th and j-th balls in contact,
+// (nx, ny) is the normal versor pointing from the j-th to the i-th ball
+static void collide_pair(struct sim_state *s, int i, int j, float nx, float ny)
+{
+        // remember which ball the cue ball touches first
+        if (s->first_hit < 0) {
+            if (i == SIM_CUE) s->first_hit = j;
+            if (j == SIM_CUE) s->first_hit = i;
+        }
+
+        // a touched ball wakes up
+        wake_ball(s, i);
+        wake_ball(s, j);
+
+        bounce(s->dump, nx, ny, &s->vx[i], &s->vy[i], &s->vx[j], &s->vy[j]);
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_COLLISION(s, i, j):
+// separates the i-th and j-th balls if they overlap and makes them collide,
+// returns 1 if they did
+static int handle_collision(struct sim_state *s, int i, int j)
+{
+float   d2, d;              // squared distance and distance between balls
+float   e;                  // ball intersection
+float   nx, ny;             // normal versor components
+
+        d2 = (s->x[i] - s->x[j])*(s->x[i] - s->x[j]) + (s->y[i] - s->y[j])*(s->y[i] - s->y[j]);
+
+        // same float comparison as the kernels, so every build finds the same contacts
+        if (d2 < (float) (DIAM*DIAM)) {
+
+            d = sqrt(d2);
+
+            // versors definition
+            nx = (s->x[i] - s->x[j]) / d;
+            ny = (s->y[i] - s->y[j]) / d;
+
+            e = DIAM - d;
+
+            // Solve compenetration
+            s->x[i] += (e/2) * nx;
+            s->y[i] += (e/2) * ny;
+
+            s->x[j] -= (e/2) * nx;
+            s->y[j] -= (e/2) * ny;
+
+            // Solve partially anelastic collision
+            collide_pair(s, i, j, nx, ny);
+            return 1;
+        }
+        return 0;
+}
+
+//---------------------------------------------------------------------------------
+// CONTACT SOLVER
+//---------------------------------------------------------------------------------
+// All the contacts of a step are solved together by Gauss-Seidel iterations on the
+// normal impulses, clamped so balls are only pushed apart; the impulses of the step
+// before are applied first, so a cluster at rest (e.g. the break) starts close to
+// its solution. Balls have the same mass, each takes half of a relative change.
+
+#define     CT_TOL      1e-5        // impulse change under which the iterations stop [m/s]
+
+//---------------------------------------------------------------------------------
+// ADD_CONTACT(s, i, j, bounce):
+// records the contact between the i-th and j-th balls if they overlap; without
+// bounce the balls are only kept from approaching, as needed for the contacts made
+// by the solver itself, whose velocities are not the ones before the impact
+static void add_contact(struct sim_state *s, int i, int j, int bounce)
+{
+struct sim_contact *c;
+float   d2, d;              // squared distance and distance between balls
+float   vn;                 // relative normal velocity, negative if approaching
+float   e;                  // restitution
+int     k, w;               // positions in the contact list
+
+        d2 = (s->x[i] - s->x[j])*(s->x[i] - s->x[j]) + (s->y[i] - s->y[j])*(s->y[i] - s->y[j]);
+        if (d2 >= (float) (DIAM*DIAM) || s->ncontact == SIM_MAX_CONTACTS) return;
+
+        if (i > j) { k = i; i = j; j = k; }
+
+        // sorted by pair, so the warm start can find it; a pair is listed once
+        for (k = s->ncontact; k > 0 && (s->contact[k - 1].i > i ||
+             (s->contact[k - 1].i == i && s->contact[k - 1].j > j)); k--);
+        if (k > 0 && s->contact[k - 1].i == i && s->contact[k - 1].j == j) return;
+
+        // remember which ball the cue ball touches first
+        if (s->first_hit < 0) {
+            if (i == SIM_CUE) s->first_hit = j;
+            if (j == SIM_CUE) s->first_hit = i;
+        }
+
+        // a touched ball wakes up
+        wake_ball(s, i);
+        wake_ball(s, j);
+
+        for (w = s->ncontact; w > k; w--) s->contact[w] = s->contact[w - 1];
+
+        c = &s->contact[k];
+        s->ncontact++;
+
+        d = sqrt(d2);
+        c->i = i;
+        c->j = j;
+        c->nx = (d > 0) ? (s->x[i] - s->x[j]) / d : 1;
+        c->ny = (d > 0) ? (s->y[i] - s->y[j]) / d : 0;
+        c->imp = 0;
+
+        // same energy loss as collide_pair() for a ball hitting a still one
+        e = 2*s->dump*s->dump - 1;
+        e = (e > 0) ? sqrt(e) : 0;
+        vn = (s->vx[i] - s->vx[j]) * c->nx + (s->vy[i] - s->vy[j]) * c->ny;
+        c->target = (vn < 0 && bounce) ? - e * vn : 0;
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_CONTACT(s, i, j):
+// records the contact between the i-th and j-th balls for the solver, or resolves
+// it at once without it; returns 1 if the balls moved
+static int handle_contact(struct sim_state *s, int i, int j)
+{
+        if (s->solver) {
+            add_contact(s, i, j, 1);
+            return 0;
+        }
+        return handle_collision(s, i, j);
+}
+
+//---------------------------------------------------------------------------------
+// APPLY_IMPULSE(s, c, p):
+// changes the relative normal velocity of the balls in contact c by 2 p
+static void apply_impulse(struct sim_state *s, const struct sim_contact *c, float p)
+{
+        s->vx[c->i] += p * c->nx;
+        s->vy[c->i] += p * c->ny;
+        s->vx[c->j] -= p * c->nx;
+        s->vy[c->j] -= p * c->ny;
+}
+
+//---------------------------------------------------------------------------------
+// BUILD_GRID(s, g, list, count):
+// puts the count balls of list in the grid g, each in the list of its cell; cells
+// of older builds are recognized by their stamp, so the grid is never cleared
+static void build_grid(const struct sim_state *s, struct sim_grid *g, const int *list, int count)
+{
+int     k, i, c;    // list position, ball and cell indexes
+int     cx, cy;     // cell coordinates
+
+        g->gen++;
+
+        for (k = count - 1; k >= 0; k--) {
+
+            i = list[k];
+
+            // one cell of margin on the left and upper side for the holes
+            cx = (int) ((s->x[i] + DIAM) / s->cell);
+            cy = (int) ((s->y[i] + DIAM) / s->cell);
+            if (cx < 0) cx = 0;
+            if (cx > SIM_GX - 1) cx = SIM_GX - 1;
+            if (cy < 0) cy = 0;
+            if (cy > SIM_GY - 1) cy = SIM_GY - 1;
+
+            c = cy * SIM_GX + cx;
+            if (g->stamp[c] != g->gen) {
+                g->stamp[c] = g->gen;
+                g->head[c] = -1;
+            }
+
+            // balls are inserted backwards so each cell keeps the list order
+            g->cell[i] = c;
+            g->next[i] = g->head[c];
+            g->head[c] = i;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_PAIRS(s, list, count):
+// tests every candidate pair among the count awake balls of list once: each ball
+// against the balls that follow it in its cell and against the right, lower-left,
+// lower and lower-right cells of the awake grid, then against the nine cells
+// around it in the grid of the sleeping balls
+static void handle_pairs(struct sim_state *s, const int *list, int count)
+{
+static const int ncx[4] = {1, -1, 0, 1};    // neighbour cell offsets along x
+static const int ncy[4] = {0, 1, 1, 1};     // neighbour cell offsets along y
+struct sim_grid *g = &s->grid;
+struct sim_grid *r = &s->rest_grid;
+int     sleeping[SIM_MAX_BALLS];            // sleeping balls on the table
+int     n_sleeping = 0;
+int     k, i, j, l;     // list position, ball and neighbour indexes
+int     cx, cy;         // cell coordinates
+int     nx, ny, nc;     // neighbour cell coordinates and index
+
+        build_grid(s, g, list, count);
+
+        // the sleeping balls do not move, their grid changes only when one falls asleep or wakes up
+        if (s->rest_dirty) {
+            for (i = 0; i < s->n; i++) {
+                if (s->active[i] && !s->awake[i]) sleeping[n_sleeping++] = i;
+            }
+            build_grid(s, r, sleeping, n_sleeping);
+            s->rest_dirty = 0;
+        }
+
+        for (k = 0; k < count; k++) {
+
+            i = list[k];
+
+            for (j = g->next[i]; j >= 0; j = g->next[j])
+                handle_contact(s, i, j);
+
+            cx = g->cell[i] % SIM_GX;
+            cy = g->cell[i] / SIM_GX;
+
+            for (l = 0; l < 4; l++) {
+
+                nx = cx + ncx[l];
+                ny = cy + ncy[l];
+                if (nx < 0 || nx >= SIM_GX || ny >= SIM_GY) continue;
+
+                nc = ny * SIM_GX + nx;
+                if (g->stamp[nc] != g->gen) continue;
+
+                for (j = g->head[nc]; j >= 0; j = g->next[j])
+                    handle_contact(s, i, j);
+            }
+
+            for (ny = cy - 1; ny <= cy + 1; ny++) {
+                for (nx = cx - 1; nx <= cx + 1; nx++) {
+
+                    if (nx < 0 || nx >= SIM_GX || ny < 0 || ny >= SIM_GY) continue;
+
+                    nc = ny * SIM_GX + nx;
+                    if (r->stamp[nc] != r->gen) continue;
+
+                    // balls woken up during this step are still listed here and
+                    // still need the test, as they are not in the awake grid
+                    for (j = r->head[nc]; j >= 0; j = r->next[j])
+                        handle_contact(s, i, j);
+                }
+            }
+        }
+}
+
+//---------------------------------------------------------------------------------
+// IN_LIST(list, count, i):
+// returns 1 if the i-th ball is in the list of count balls sorted by index
+static int in_list(const int *list, int count, int i)
+{
+int     lo = 0, hi = count - 1, k;
+
+        while (lo <= hi) {
+            k = (lo + hi) / 2;
+            if (list[k] == i) return 1;
+            if (list[k] < i) lo = k + 1;
+            else             hi = k - 1;
+        }
+        return 0;
+}
+
+//---------------------------------------------------------------------------------
+// HANDLE_ALL_PAIRS(s, list, count):
+// tests each of the count awake balls of list against every other ball on the table
+// with the vectorized distance kernel, cheaper than the grid while the table holds
+// few balls; a pair of awake balls is tested by the one with the lower index
+static void handle_all_pairs(struct sim_state *s, const int *list, int count)
+{
+int     k, i, j, j0;    // list position, ball indexes and first ball of a block
+unsigned m;             // overlapping balls of the block
+
+        for (k = 0; k < count; k++) {
+
+            i = list[k];
+
+            for (j0 = 0; j0 < s->n; j0 += SIM_LANES) {
+
+                m = overlap_mask(s, i, j0);
+
+                for (j = j0; m; j++, m >>= 1) {
+                    if (!(m & 1) || j == i || j >= s->n || !s->active[j]) continue;
+                    if (s->awake[j] && j < i && in_list(list, count, j)) continue;
+
+                    // a contact moves the i-th ball: test the rest of the block again,
+                    // so the result does not depend on the number of lanes
+                    if (handle_contact(s, i, j)) m = overlap_mask(s, i, j0) >> (j - j0);
+                }
+            }
+        }
+}
+
+//---------------------------------------------------------------------------------
+// SOLVE_VELOCITY(s, c):
+// one Gauss-Seidel update of the impulse of contact c, returns its change
+static float solve_velocity(struct sim_state *s, struct sim_contact *c)
+{
+float   vn;                 // relative normal velocity
+float   p, imp;             // impulse change and new accumulated impulse
+
+        vn = (s->vx[c->i] - s->vx[c->j]) * c->nx + (s->vy[c->i] - s->vy[c->j]) * c->ny;
+
+        imp = c->imp + (c->target - vn) / 2;
+        if (imp < 0) imp = 0;
+        p = imp - c->imp;
+        c->imp = imp;
+
+        apply_impulse(s, c, p);
+        return fabs(p);
+}
+
+//---------------------------------------------------------------------------------
+// SOLVE_POSITION(s, c):
+// separates the balls of contact c if they overlap, returns the correction of each
+static float solve_position(struct sim_state *s, struct sim_contact *c)
+{
+float   dx, dy, d2, d;      // distance between balls
+float   e;                  // half of the overlap
+
+        dx = s->x[c->i] - s->x[c->j];
+        dy = s->y[c->i] - s->y[c->j];
+        d2 = dx*dx + dy*dy;
+        if (d2 >= (float) (DIAM*DIAM)) return 0;
+
+        d = sqrt(d2);
+        if (d > 0) {
+            c->nx = dx / d;
+            c->ny = dy / d;
+        }
+
+        e = (DIAM - d) / 2;
+        s->x[c->i] += e * c->nx;
+        s->y[c->i] += e * c->ny;
+        s->x[c->j] -= e * c->nx;
+        s->y[c->j] -= e * c->ny;
+
+        return e;
+}
+
+//---------------------------------------------------------------------------------
+// SOLVE_VELOCITIES(s):
+// Gauss-Seidel iterations on the normal impulses of the contacts
+static void solve_velocities(struct sim_state *s)
+{
+int     k, it;              // contact and iteration indexes
+float   p, dp;              // impulse change, largest one of an iteration
+
+        for (it = 0; it < SIM_ITERS; it++) {
+
+            dp = 0;
+            for (k = 0; k < s->ncontact; k++) {
+                p = solve_velocity(s, &s->contact[k]);
+                if (p > dp) dp = p;
+            }
+            if (dp < CT_TOL) break;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// SOLVE_POSITIONS(s):
+// Gauss-Seidel iterations separating the overlapping balls in contact
+static void solve_positions(struct sim_state *s)
+{
+int     k, it;              // contact and iteration indexes
+float   e, de;              // correction, largest one of an iteration
+
+        for (it = 0; it < SIM_ITERS; it++) {
+
+            de = 0;
+            for (k = 0; k < s->ncontact; k++) {
+                e = solve_position(s, &s->contact[k]);
+                if (e > de) de = e;
+            }
+            if (de < CT_TOL * DIAM) break;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// PARALLEL SOLVER
+//---------------------------------------------------------------------------------
+// Contacts are colored so that two contacts of the same color never share a ball:
+// the contacts of a color are solved at the same time by all the threads, the
+// colors one after the other. The order is the same for any number of threads, so
+// the result does not depend on it, and it is within CT_TOL of the serial solver.
+
+#define     JOB_VEL     0       // velocity iterations
+#define     JOB_POS     1       // position iterations
+#define     JOB_QUIT    2       // workers exit
+
+//---------------------------------------------------------------------------------
+// COLOR_CONTACTS(s):
+// greedy coloring of the contacts, then grouping by color in order[]; a contact
+// that finds every color taken goes to the last one, which is solved serially
+static void color_contacts(struct sim_state *s)
+{
+unsigned used[SIM_MAX_BALLS];       // colors taken by the contacts of each ball
+unsigned char color[SIM_MAX_CONTACTS];
+unsigned m;                         // colors still free for a contact
+int     count[SIM_MAX_COLORS];
+int     k, c;                       // contact and color indexes
+
+        for (k = 0; k < s->ncontact; k++)
+            used[s->contact[k].i] = used[s->contact[k].j] = 0;
+        for (c = 0; c < SIM_MAX_COLORS; c++) count[c] = 0;
+
+        s->ncolor = 0;
+        for (k = 0; k < s->ncontact; k++) {
+
+            m = ~(used[s->contact[k].i] | used[s->contact[k].j]) & ~(1u << (SIM_MAX_COLORS - 1));
+            c = m ? __builtin_ctz(m) : SIM_MAX_COLORS - 1;
+
+            used[s->contact[k].i] |= 1u << c;
+            used[s->contact[k].j] |= 1u << c;
+            color[k] = c;
+            count[c]++;
+            if (c >= s->ncolor) s->ncolor = c + 1;
+        }
+
+        s->color_start[0] = 0;
+        for (c = 0; c < s->ncolor; c++) s->color_start[c + 1] = s->color_start[c] + count[c];
+
+        // stable, so each color keeps the contacts sorted by pair
+        for (c = 0; c < s->ncolor; c++) count[c] = s->color_start[c];
+        for (k = 0; k < s->ncontact; k++) s->order[count[color[k]]++] = k;
+}
+
+//---------------------------------------------------------------------------------
+// RUN_BATCHES(s, t, job):
+// iterations of the job done by the t-th thread: its share of each color, then the
+// barrier; all threads see the same largest change, so they stop together
+static void run_batches(struct sim_state *s, int t, int job)
+{
+struct sim_pool *p = &s->pool;
+int     it, c, k, u;        // iteration, color, contact and thread indexes
+int     lo, hi, len;        // entries of order[] done by this thread
+float   d, dmax;            // change of a contact, largest one
+float   tol = (job == JOB_VEL) ? CT_TOL : CT_TOL * DIAM;
+
+        for (it = 0; it < SIM_ITERS; it++) {
+
+            dmax = 0;
+            for (c = 0; c < s->ncolor; c++) {
+
+                lo = s->color_start[c];
+                hi = s->color_start[c + 1];
+                if (lo == hi) continue;
+
+                if (c == SIM_MAX_COLORS - 1) {
+                    if (t != 0) lo = hi;
+                }
+                else {
+                    len = hi - lo;
+                    hi = lo + len * (t + 1) / p->n;
+                    lo = lo + len * t / p->n;
+                }
+
+                for (k = lo; k < hi; k++) {
+                    if (job == JOB_VEL) d = solve_velocity(s, &s->contact[s->order[k]]);
+                    else                d = solve_position(s, &s->contact[s->order[k]]);
+                    if (d > dmax) dmax = d;
+                }
+
+                pthread_barrier_wait(&p->bar);
+            }
+
+            // nobody writes dmax[] again before everybody passed the next color barrier
+            p->dmax[t] = dmax;
+            pthread_barrier_wait(&p->bar);
+
+            for (u = 0, dmax = 0; u < p->n; u++)
+                if (p->dmax[u] > dmax) dmax = p->dmax[u];
+            if (dmax < tol) break;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// WORKER(arg):
+// body of a worker thread: waits for a job, does its share, waits for the others
+static void *worker(void *arg)
+{
+struct sim_pool *p = arg;
+int     t;          // thread index
+
+        // wait for sim_set_threads() to start every thread
+        pthread_mutex_lock(&p->lock);
+        t = ++p->next_id;
+        pthread_mutex_unlock(&p->lock);
+
+        for (;;) {
+            pthread_barrier_wait(&p->bar);
+            if (p->job == JOB_QUIT) return NULL;
+            run_batches(p->s, t, p->job);
+            pthread_barrier_wait(&p->bar);
+        }
+}
+
+//---------------------------------------------------------------------------------
+// RUN_JOB(s, job):
+// does the job with all the threads, the caller as thread 0
+static void run_job(struct sim_state *s, int job)
+{
+        s->pool.job = job;
+        pthread_barrier_wait(&s->pool.bar);
+        if (job == JOB_QUIT) return;
+        run_batches(s, 0, job);
+        pthread_barrier_wait(&s->pool.bar);
+}
+
+//---------------------------------------------------------------------------------
+// FIND_CONTACTS(s, moved):
+// adds the contacts between the balls moved by the solver and any other ball
+static void find_contacts(struct sim_state *s, const int *moved)
+{
+struct sim_grid *g = &s->grid;
+int     list[SIM_MAX_BALLS];    // active balls
+int     count = 0;
+int     i, j, j0;               // ball indexes and first ball of a block
+int     cx, cy, nx, ny, nc;     // cell coordinates and index
+unsigned m;                     // overlapping balls of a block
+
+        if (s->n < SIM_GRID_MIN) {
+            for (i = 0; i < s->n; i++) {
+
+                if (!moved[i]) continue;
+
+                for (j0 = 0; j0 < s->n; j0 += SIM_LANES) {
+                    m = overlap_mask(s, i, j0);
+                    for (j = j0; m; j++, m >>= 1) {
+                        if ((m & 1) && j != i && j < s->n && s->active[j]) add_contact(s, i, j, 0);
+                    }
+                }
+            }
+            return;
+        }
+
+        // on large tables through a grid of every ball, the pair tests are over
+        for (i = 0; i < s->n; i++) {
+            if (s->active[i]) list[count++] = i;
+        }
+        build_grid(s, g, list, count);
+
+        for (i = 0; i < s->n; i++) {
+
+            if (!moved[i]) continue;
+
+            cx = g->cell[i] % SIM_GX;
+            cy = g->cell[i] / SIM_GX;
+
+            for (ny = cy - 1; ny <= cy + 1; ny++) {
+                for (nx = cx - 1; nx <= cx + 1; nx++) {
+
+                    if (nx < 0 || nx >= SIM_GX || ny < 0 || ny >= SIM_GY) continue;
+
+                    nc = ny * SIM_GX + nx;
+                    if (g->stamp[nc] != g->gen) continue;
+
+                    for (j = g->head[nc]; j >= 0; j = g->next[j]) {
+                        if (j != i) add_contact(s, i, j, 0);
+                    }
+                }
+            }
+        }
+}
+
+//---------------------------------------------------------------------------------
+// SOLVE_CONTACTS(s):
+// solves the contacts gathered in the step: warm start, then rounds of velocity
+// and position iterations, on the worker threads for many contacts; a round that
+// pushes a ball into another one adds the new contact and starts another round,
+// at most SIM_ITERS
+static void solve_contacts(struct sim_state *s)
+{
+struct sim_contact *c;
+int     k, w, round;        // contact, warm contact and round indexes
+int     n0;                 // contacts before looking for new ones
+int     par;                // 1 if the worker threads solve this round
+int     moved[SIM_MAX_BALLS];
+
+        // warm start from the impulse the same pair had in the step before
+        for (k = 0, w = 0; k < s->ncontact; k++) {
+
+            c = &s->contact[k];
+            while (w < s->nwarm && (s->warm[w].i < c->i || (s->warm[w].i == c->i && s->warm[w].j < c->j))) w++;
+
+            if (w < s->nwarm && s->warm[w].i == c->i && s->warm[w].j == c->j) {
+                c->imp = s->warm[w].imp;
+                apply_impulse(s, c, c->imp);
+            }
+        }
+
+        for (round = 0; round < SIM_ITERS && s->ncontact > 0; round++) {
+
+            // the exact mode keeps the serial order, the same on every machine
+            par = (s->pool.n > 1 && !s->exact && s->ncontact >= SIM_PAR_MIN);
+
+            if (par) {
+                color_contacts(s);
+                run_job(s, JOB_VEL);
+                run_job(s, JOB_POS);
+            }
+            else {
+                solve_velocities(s);
+                solve_positions(s);
+            }
+
+            // the balls moved by the solver may overlap balls out of the contact list
+            for (k = 0; k < s->n; k++) moved[k] = 0;
+            for (k = 0; k < s->ncontact; k++) moved[s->contact[k].i] = moved[s->contact[k].j] = 1;
+
+            n0 = s->ncontact;
+            find_contacts(s, moved);
+            if (s->ncontact == n0) break;
+        }
+
+        // keep the impulses for the next step
+        for (k = 0; k < s->ncontact; k++) s->warm[k] = s->contact[k];
+        s->nwarm = s->ncontact;
+        s->ncontact = 0;
+}
+
+//---------------------------------------------------------------------------------
+// EVENT-DRIVEN MODE
+//---------------------------------------------------------------------------------
+// Friction slows every ball by the same factor, v(t) = v0 exp(-k t), so between two
+// impacts the balls move on straight lines parametrized by the common travelled
+// length S(t) = (1 - exp(-k t)) / k: each impact is the root of a polynomial in S.
+
+#define     EV_NONE     0       // no impact before the end of the step
+#define     EV_PAIR     1       // impact between two balls
+#define     EV_WALL     2       // impact with a cushion
+#define     EV_HOLE     3       // ball falling in a hole
+#define     EV_REST     4       // ball slowing under the sleeping threshold
+
+#define     EV_VTOL     1e-6            // tolerance on the approaching velocity [m/s]
+
+//---------------------------------------------------------------------------------
+// SLAB(p, v, p0, p1, lo, hi):
+// restricts [lo, hi] to the travelled lengths for which p + v S lies in [p0, p1],
+// returns 0 if the interval becomes empty
+static int slab(double p, double v, double p0, double p1, double *lo, double *hi)
+{
+double  s0, s1;     // travelled lengths at p0 and p1
+
+        if (v == 0) return (p >= p0 && p <= p1 && *lo <= *hi);
+
+        s0 = (p0 - p) / v;
+        s1 = (p1 - p) / v;
+        if (s0 > s1) { double tmp = s0; s0 = s1; s1 = tmp; }
+
+        if (s0 > *lo) *lo = s0;
+        if (s1 < *hi) *hi = s1;
+
+        return (*lo <= *hi);
+}
+
+//---------------------------------------------------------------------------------
+// NEXT_EVENT(s, k, S, a, b):
+// looks for the first event of an awake ball within the travelled length S, with
+// friction rate k; if there is one, S is shortened to it, a and b get the balls
+// or the ball and the cushion/hole
+static int next_event(const struct sim_state *s, double k, double *S, int *a, int *b)
+{
+const struct sim_wall *w;
+int     type = EV_NONE;
+int     l;                  // position in the awake list
+int     i, j;               // ball, cushion or hole indexes
+double  qx, qy;             // relative position [m]
+double  wx, wy;             // relative velocity [m/s]
+double  A, B, C, D;         // coefficients and discriminant of A S^2 + 2 B S + C = 0
+double  Si;                 // travelled length at impact [m s]
+double  vn, dist;           // approaching velocity and distance from a cushion
+double  lo, hi;             // travelled lengths entering and leaving a cushion region
+
+        for (l = 0; l < s->n_awake; l++) {
+
+            i = s->wake_list[l];
+
+            // ball to ball: |q + w S| = DIAM while approaching, a pair of
+            // awake balls is tested by the one with the lower index
+            for (j = 0; j < s->n; j++) {
+
+                if (j == i || !s->active[j] || (s->awake[j] && j < i)) continue;
+
+                qx = s->x[i] - s->x[j];     qy = s->y[i] - s->y[j];
+                wx = s->vx[i] - s->vx[j];   wy = s->vy[i] - s->vy[j];
+
+                // balls leaving a contact with the same normal velocity are not approaching
+                B = qx*wx + qy*wy;
+                if (B >= - EV_VTOL * DIAM) continue;
+
+                A = wx*wx + wy*wy;
+                C = qx*qx + qy*qy - DIAM*DIAM;
+                D = B*B - A*C;
+                if (D < 0) continue;
+
+                Si = (C <= 0) ? 0 : (- B - sqrt(D)) / A;
+                if (Si < *S) {
+                    *S = Si; *a = i; *b = j;
+                    type = EV_PAIR;
+                }
+            }
+
+            if (s->vx[i] == 0 && s->vy[i] == 0) continue;
+
+            // ball to cushion: the centre enters the region behind the line, either
+            // across the line or from the side after running in a hole gap
+            for (j = 0; j < SIM_N_WALLS; j++) {
+
+                w = &s->wall[j];
+                vn = w->nx * s->vx[i] + w->ny * s->vy[i];
+                if (vn <= 0) continue;
+
+                dist = w->c - (w->nx * s->x[i] + w->ny * s->y[i]);
+                lo = (dist > 0) ? dist / vn : 0;
+                hi = *S;
+
+                if (!slab(s->x[i], s->vx[i], w->x0, w->x1, &lo, &hi)) continue;
+                if (!slab(s->y[i], s->vy[i], w->y0, w->y1, &lo, &hi)) continue;
+                if (lo >= *S) continue;
+
+                *S = lo; *a = i; *b = j;
+                type = EV_WALL;
+            }
+
+            // ball to hole: the centre gets closer than the hole radius to the hole centre
+            for (j = 0; j < N_HOLES; j++) {
+
+                qx = s->x[i] - s->hole[j].x;
+                qy = s->y[i] - s->hole[j].y;
+
+                B = qx*s->vx[i] + qy*s->vy[i];
+                if (B >= 0) continue;
+
+                A = s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i];
+                C = qx*qx + qy*qy - s->hp2;
+                D = B*B - A*C;
+                if (D < 0) continue;
+
+                Si = (C <= 0) ? 0 : (- B - sqrt(D)) / A;
+                if (Si < *S) {
+                    *S = Si; *a = i; *b = j;
+                    type = EV_HOLE;
+                }
+            }
+
+            // ball falling asleep: v exp(-k t) = thres, with exp(-k t) = 1 - k S
+            if (k > 0) {
+
+                vn = sqrt(s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i]);
+                Si = (vn > s->thres) ? (1 - s->thres / vn) / k : 0;
+                if (Si < *S) {
+                    *S = Si; *a = i;
+                    type = EV_REST;
+                }
+            }
+        }
+
+        return type;
+}
+
+//---------------------------------------------------------------------------------
+// DRIFT(s, S, k):
+// moves every awake ball by the travelled length S and applies the friction decay
+static void drift(struct sim_state *s, double S, double k)
+{
+int     l, i;
+float   decay = 1 - k * S;  // exp(-k t) at the end of the drift
+
+        for (l = 0; l < s->n_awake; l++) {
+
+            i = s->wake_list[l];
+
+            s->x[i] += s->vx[i] * S;
+            s->y[i] += s->vy[i] * S;
+            s->vx[i] *= decay;
+            s->vy[i] *= decay;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// ADVANCE_EVENTS(s, T, k):
+// advances the table by T seconds with friction rate k [1/s], resolving the
+// events in time order; returns the number of events resolved
+static int advance_events(struct sim_state *s, double T, double k)
+{
+int     n_ev = 0;       // number of impacts
+int     type;           // type of the next impact
+int     a = 0, b = 0;   // objects involved in the next impact
+double  t = 0;          // elapsed time [s]
+double  S;              // travelled length to the next impact or to T [m s]
+float   d;              // distance between balls
+
+        if (s->n_awake > 0) s->moves++;
+
+        while (t < T) {
+
+            S = (k > 0) ? (1 - exp(- k * (T - t))) / k : T - t;
+
+            // past the limit just let the balls drift to the end of the step
+            type = (n_ev < SIM_MAX_EVENTS) ? next_event(s, k, &S, &a, &b) : EV_NONE;
+
+            drift(s, S, k);
+
+            if (type == EV_NONE || s->n_awake == 0) break;
+
+            t += (k > 0) ? - log(1 - k * S) / k : S;
+            n_ev++;
+
+            switch (type) {
+
+                case EV_PAIR:
+                    d = sqrt((s->x[a] - s->x[b])*(s->x[a] - s->x[b]) + (s->y[a] - s->y[b])*(s->y[a] - s->y[b]));
+                    collide_pair(s, a, b, (s->x[a] - s->x[b]) / d, (s->y[a] - s->y[b]) / d);
+                    break;
+
+                case EV_WALL:
+                    hit_wall(s, a, b);
+                    break;
+
+                case EV_HOLE:
+                    pocket_ball(s, a, b);
+                    break;
+
+                case EV_REST:
+                    sleep_ball(s, a);
+                    break;
+            }
+        }
+
+        return n_ev;
+}
+
+//---------------------------------------------------------------------------------
+// FRICTION_RATE(f):
+// exponential decay rate equivalent to losing a fraction f of velocity every SIM_T_REF
+static double friction_rate(float f)
+{
+        if (f <= 0) return 0;
+        return - log(1 - f) / SIM_T_REF;
+}
+
+//---------------------------------------------------------------------------------
+// SHOT SEARCH
+//---------------------------------------------------------------------------------
+// A coarse rollout plays a candidate shot on a light copy of the balls: steps of up
+// to two diameters with swept ball tests (two balls meeting during a step are put
+// back where they touched), only the straight cushions (a ball past the field bounds
+// is taken as pocketed) and each ball stopped as soon as it cannot travel half a
+// diameter more. Only the best candidates are played again with the full engine.
+
+#define     CO_CFL      2               // largest move of a ball in a coarse step [diameters]
+#define     CO_MAX_STEPS    1000        // coarse steps after which a rollout stops anyway
+
+//---------------------------------------------------------------------------------
+// COARSE_ROLLOUT(s, theta, v, value):
+// plays the shot (theta, v) from the state s, which is not changed, and returns its
+// score: the value of the pocketed balls, minus one if the cue ball touches nothing,
+// plus up to half a point for a ball worth pocketing that got close to a hole, so
+// near misses rank before shots that go nowhere
+static float coarse_rollout(const struct sim_state *s, float theta, float v, const float *value)
+{
+float   x[SIM_MAX_BALLS], y[SIM_MAX_BALLS];     // position [m]
+float   vx[SIM_MAX_BALLS], vy[SIM_MAX_BALLS];   // velocity [m/s]
+float   mx[SIM_MAX_BALLS], my[SIM_MAX_BALLS];   // displacement in the last step [m]
+int     active[SIM_MAX_BALLS];                  // 1 while the ball is on the table
+int     moving[SIM_MAX_BALLS];                  // 1 if the ball is in list
+int     list[SIM_MAX_BALLS];                    // moving balls
+int     count = 0;                              // number of moving balls
+int     first_hit = -1;                         // first ball touched by the cue ball
+float   score = 0;
+float   near = 0;                               // squared radius of a hole over the squared distance of the closest miss
+double  k = friction_rate(s->f);                // friction rate [1/s]
+double  decay, S;                               // friction decay and travelled length of a step [m s]
+int     st;                                     // step index
+float   vstop;                                  // speed of a ball that can travel DIAM/2 more [m/s]
+float   v2, vmax;                               // squared and top speed [m/s]
+float   dx, dy, d2, d, e, nx, ny;
+float   wx, wy, w2, pw, D, u;                   // relative displacement, root of the contact
+const struct sim_wall *w;
+int     l, i, j, h;                             // list position, ball, ball / cushion and hole indexes
+
+        for (i = 0; i < s->n; i++) {
+            x[i] = s->x[i];     y[i] = s->y[i];
+            vx[i] = s->vx[i];   vy[i] = s->vy[i];
+            mx[i] = my[i] = 0;
+            active[i] = s->active[i];
+            moving[i] = active[i] && (vx[i] != 0 || vy[i] != 0);
+            if (moving[i]) list[count++] = i;
+        }
+
+        vx[SIM_CUE] = v * cos(theta);
+        vy[SIM_CUE] = v * sin(theta);
+        if (!moving[SIM_CUE]) {
+            moving[SIM_CUE] = 1;
+            list[count++] = SIM_CUE;
+        }
+
+        vstop = (k > 0) ? k * DIAM/2 : s->thres;
+
+        for (st = 0; st < CO_MAX_STEPS && count > 0; st++) {
+
+            vmax = 0;
+            for (l = 0; l < count; l++) {
+                i = list[l];
+                v2 = vx[i]*vx[i] + vy[i]*vy[i];
+                if (v2 > vmax*vmax) vmax = sqrt(v2);
+            }
+
+            // no ball can travel half a diameter more, and S would be infinite at zero speed
+            if (vmax == 0 || vmax < vstop) break;
+
+            // the step is as long as the fastest ball takes to travel CO_CFL diameters,
+            // S = (1 - decay) / k, or until every ball stops
+            S = CO_CFL * DIAM / vmax;
+            decay = 1 - k * S;
+            if (decay < 0) {
+                decay = 0;
+                S = 1 / k;
+            }
+
+            for (l = 0; l < count; l++) {
+
+                i = list[l];
+                mx[i] = vx[i] * S;
+                my[i] = vy[i] * S;
+                x[i] += mx[i];
+                y[i] += my[i];
+                vx[i] *= decay;
+                vy[i] *= decay;
+
+                // straight cushions only, no tunnel walls
+                for (j = 0; j < SIM_N_WALLS; j++) {
+                    w = &s->wall[j];
+                    if (!w->rail || x[i] < w->x0 || x[i] > w->x1 || y[i] < w->y0 || y[i] > w->y1) continue;
+                    e = w->nx * x[i] + w->ny * y[i] - w->c;     // penetration [m]
+                    d = w->nx * vx[i] + w->ny * vy[i];          // outward velocity [m/s]
+                    if (e > 0 && d > 0) {
+                        x[i] -= e * w->nx;
+                        y[i] -= e * w->ny;
+                        vx[i] -= (1 + s->dump) * d * w->nx;
+                        vy[i] -= (1 + s->dump) * d * w->ny;
+                    }
+                }
+
+                // holes, and the gaps in the cushions that lead to them
+                for (h = 0; h < N_HOLES; h++) {
+                    dx = x[i] - s->hole[h].x;
+                    dy = y[i] - s->hole[h].y;
+                    d2 = dx*dx + dy*dy;
+                    if (d2 < s->hp2) break;
+                    if ((value ? value[i] > 0 : i != SIM_CUE) && s->hp2 > near * d2) near = s->hp2 / d2;
+                }
+                if (h < N_HOLES || x[i] < 0 || x[i] > s->table.lx || y[i] < 0 || y[i] > s->table.ly) {
+                    active[i] = 0;
+                    vx[i] = vy[i] = 0;
+                    score += value ? value[i] : (i == SIM_CUE) ? -2 : 1;
+                }
+            }
+
+            // each moving ball against every other ball on the table
+            for (l = 0; l < count; l++) {
+
+                i = list[l];
+                if (!active[i]) continue;
+
+                for (j = 0; j < s->n; j++) {
+
+                    if (j == i || !active[j] || (moving[j] && j < i)) continue;
+
+                    // distance at the end of the step and relative displacement
+                    dx = x[i] - x[j];
+                    dy = y[i] - y[j];
+                    wx = mx[i] - mx[j];
+                    wy = my[i] - my[j];
+                    if (fabs(dx) - fabs(wx) >= (float) DIAM || fabs(dy) - fabs(wy) >= (float) DIAM) continue;
+
+                    // going back by the fraction u of the step the distance is DIAM
+                    // for u^2 w2 - 2 u pw + d2 = DIAM^2, the larger root is the contact
+                    d2 = dx*dx + dy*dy;
+                    w2 = wx*wx + wy*wy;
+                    pw = dx*wx + dy*wy;
+                    D = pw*pw - w2 * (d2 - (float) (DIAM*DIAM));
+                    if (d2 >= (float) (DIAM*DIAM) && (D < 0 || pw <= 0 || w2 == 0 || pw - sqrt(D) > w2)) continue;
+
+                    u = (w2 > 0 && D > 0) ? (pw + sqrt(D)) / w2 : 0;
+                    if (u > 1) u = 1;
+                    x[i] -= u * mx[i];  y[i] -= u * my[i];
+                    x[j] -= u * mx[j];  y[j] -= u * my[j];
+                    mx[i] *= 1 - u;     my[i] *= 1 - u;
+                    mx[j] *= 1 - u;     my[j] *= 1 - u;
+
+                    dx = x[i] - x[j];
+                    dy = y[i] - y[j];
+                    d = sqrt(dx*dx + dy*dy);
+                    if (d == 0) continue;
+                    nx = dx / d;
+                    ny = dy / d;
+
+                    // balls still overlapping from the start of the step are pushed apart
+                    if (d < DIAM) {
+                        e = (DIAM - d) / 2;
+                        x[i] += e * nx;     y[i] += e * ny;
+                        x[j] -= e * nx;     y[j] -= e * ny;
+                    }
+                    if ((vx[i] - vx[j]) * nx + (vy[i] - vy[j]) * ny >= 0) continue;
+
+                    bounce(s->dump, nx, ny, &vx[i], &vy[i], &vx[j], &vy[j]);
+
+                    if (first_hit < 0 && i == SIM_CUE) first_hit = j;
+                    if (first_hit < 0 && j == SIM_CUE) first_hit = i;
+
+                    if (!moving[j]) {
+                        moving[j] = 1;
+                        list[count++] = j;
+                    }
+                }
+            }
+
+            // early termination: balls that cannot get anywhere stop at once
+            for (l = count - 1; l >= 0; l--) {
+                i = list[l];
+                if (!active[i] || vx[i]*vx[i] + vy[i]*vy[i] < vstop*vstop) {
+                    vx[i] = vy[i] = 0;
+                    mx[i] = my[i] = 0;
+                    moving[i] = 0;
+                    list[l] = list[--count];
+                }
+            }
+        }
+
+        if (first_hit < 0) score -= 1;
+
+        return score + near / 2;
+}
+
+//---------------------------------------------------------------------------------
+// CMP_SHOT(a, b):
+// orders the shots by decreasing score, for qsort()
+static int cmp_shot(const void *a, const void *b)
+{
+const struct sim_shot *p = a, *q = b;
+
+        return (p->score < q->score) - (p->score > q->score);
+}
+
+//---------------------------------------------------------------------------------
+// TABLE BATCHES
+//---------------------------------------------------------------------------------
+// Independent tables are stepped in lockstep, one per vector lane: ball b of the
+// table in lane t is at [b][t] of the block (AoSoA), so every kernel loads the same
+// ball of SIM_LANES tables at once, whatever is sleeping or pocketed on each of them.
+// Same fixed step engine as step(), contacts resolved one at a time. A lane whose
+// table comes to rest is given the next table at once, so no lane waits for the
+// slowest shot of the block.
+
+#if SIM_LANES > 1
+
+// Block of SIM_LANES tables; masks are 1 or 0, empty lanes are all zero
+struct batch {
+    int     n;                                          // Balls of the largest table
+    struct  sim_state   *s[SIM_LANES];                  // Table of each lane, NULL if empty
+    int     steps[SIM_LANES];                           // Steps done by each table
+    SIM_ALIGN float x[SIM_BATCH_BALLS][SIM_LANES];      // Position [m]
+    SIM_ALIGN float y[SIM_BATCH_BALLS][SIM_LANES];
+    SIM_ALIGN float vx[SIM_BATCH_BALLS][SIM_LANES];     // Velocity [m/s]
+    SIM_ALIGN float vy[SIM_BATCH_BALLS][SIM_LANES];
+    SIM_ALIGN float act[SIM_BATCH_BALLS][SIM_LANES];    // 1 while the ball is on the table
+    SIM_ALIGN float wall[SIM_N_WALLS][8][SIM_LANES];    // Cushions: nx, ny, c, x0, x1, y0, y1, rail
+    SIM_ALIGN float hole[N_HOLES][2][SIM_LANES];        // Hole centres [m]
+    SIM_ALIGN float band[4][SIM_LANES];                 // Cushion band: x0, x1, y0, y1 [m]
+    SIM_ALIGN float hp2[SIM_LANES];                     // Squared hole radius [m^2]
+    SIM_ALIGN float decay[SIM_LANES];                   // Friction decay of a step
+    SIM_ALIGN float len[SIM_LANES];                     // Travelled length of a step [m s]
+    SIM_ALIGN float dump[SIM_LANES];                    // Bounds bouncing dumping factor
+    SIM_ALIGN float thres[SIM_LANES];                   // Sleeping speed [m/s]
+};
+
+//---------------------------------------------------------------------------------
+// BATCH_LOAD(b, t, s, dt):
+// puts the table s, already shot, in the lane t of the block b, stepped by dt seconds
+static void batch_load(struct batch *b, int t, struct sim_state *s, float dt)
+{
+int     i, j;       // ball, cushion and hole indexes
+double  k;          // friction rate [1/s]
+const struct sim_wall *w;
+
+        b->s[t] = s;
+        b->steps[t] = 0;
+        if (s->n > b->n) b->n = s->n;
+
+        for (i = 0; i < SIM_BATCH_BALLS; i++) {
+            b->x[i][t] = (i < s->n) ? s->x[i] : 0;
+            b->y[i][t] = (i < s->n) ? s->y[i] : 0;
+            b->vx[i][t] = (i < s->n && s->active[i]) ? s->vx[i] : 0;
+            b->vy[i][t] = (i < s->n && s->active[i]) ? s->vy[i] : 0;
+            b->act[i][t] = (i < s->n && s->active[i]);
+        }
+
+        for (j = 0; j < SIM_N_WALLS; j++) {
+            w = &s->wall[j];
+            b->wall[j][0][t] = w->nx;   b->wall[j][1][t] = w->ny;   b->wall[j][2][t] = w->c;
+            b->wall[j][3][t] = w->x0;   b->wall[j][4][t] = w->x1;
+            b->wall[j][5][t] = w->y0;   b->wall[j][6][t] = w->y1;
+            b->wall[j][7][t] = w->rail;
+        }
+        for (j = 0; j < N_HOLES; j++) {
+            b->hole[j][0][t] = s->hole[j].x;
+            b->hole[j][1][t] = s->hole[j].y;
+        }
+        b->band[0][t] = s->band_x0;     b->band[1][t] = s->band_x1;
+        b->band[2][t] = s->band_y0;     b->band[3][t] = s->band_y1;
+
+        k = friction_rate(s->f);
+        b->decay[t] = exp(- k * dt);
+        b->len[t] = (k > 0) ? (1 - b->decay[t]) / k : dt;
+        b->hp2[t] = s->hp2;
+        b->dump[t] = s->dump;
+        b->thres[t] = s->thres;
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_STORE(b, t):
+// copies the balls of the lane t back to its table and empties the lane
+static void batch_store(struct batch *b, int t)
+{
+struct sim_state *s = b->s[t];
+int     i;
+
+        for (i = 0; i < s->n; i++) {
+            s->x[i] = b->x[i][t];
+            s->y[i] = b->y[i][t];
+            s->vx[i] = b->vx[i][t];
+            s->vy[i] = b->vy[i][t];
+            s->active[i] = (b->act[i][t] > 0.5);
+            s->awake[i] = 0;
+        }
+
+        // rebuild the awake set, as the table was never stepped by itself
+        s->n_awake = 0;
+        for (i = 0; i < s->n; i++)
+            if (s->vx[i] != 0 || s->vy[i] != 0) wake_ball(s, i);
+        s->rest_dirty = 1;
+        s->moves++;
+        s->ncontact = s->nwarm = 0;
+
+        for (i = 0; i < SIM_BATCH_BALLS; i++)
+            b->act[i][t] = b->vx[i][t] = b->vy[i][t] = 0;
+        b->s[t] = NULL;
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_POCKET(b, i, h, t):
+// pockets the i-th ball of the table in lane t into the h-th hole
+static void batch_pocket(struct batch *b, int i, int h, int t)
+{
+struct sim_state *s = b->s[t];
+
+        b->act[i][t] = 0;
+        b->vx[i][t] = b->vy[i][t] = 0;
+        if (i != SIM_CUE) {
+            b->x[i][t] = s->xo[i];
+            b->y[i][t] = s->yo[i];
+        }
+
+        s->pocket[s->npocket].ball = i;
+        s->pocket[s->npocket].hole = h;
+        s->npocket++;
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_OUT(b, x, y, act):
+// mask of the tables whose ball at (x, y) is on the table and outside the cushion
+// band, so it may touch a cushion or a hole
+static vfloat batch_out(const struct batch *b, vfloat x, vfloat y, vfloat act)
+{
+vfloat  in;
+
+        in = VAND(VLT(VLOAD(b->band[0]), x), VLT(x, VLOAD(b->band[1])));
+        in = VAND(in, VAND(VLT(VLOAD(b->band[2]), y), VLT(y, VLOAD(b->band[3]))));
+        return VANDN(in, act);
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_WALLS(b, x, y, vx, vy, out):
+// bounces on the cushions of the balls outside the band, same as hit_wall()
+static void batch_walls(struct batch *b, vfloat *x, vfloat *y, vfloat *vx, vfloat *vy, vfloat out)
+{
+vfloat  zero = VSET(0), half = VSET(0.5), one = VSET(1), two = VSET(2);
+vfloat  dump = VLOAD(b->dump);
+vfloat  m, pen, vn, nx, ny, rail, vxr, vyr, vxt, vyt;
+const float (*w)[SIM_LANES];        // cushion
+int     j, t, bits;
+
+        for (j = 0; j < SIM_N_WALLS; j++) {
+
+            w = b->wall[j];
+            nx = VLOAD(w[0]);
+            ny = VLOAD(w[1]);
+
+            pen = VSUB(VADD(VMUL(nx, *x), VMUL(ny, *y)), VLOAD(w[2]));
+            m = VAND(out, VLT(zero, pen));
+            m = VANDN(VOR(VLT(*x, VLOAD(w[3])), VLT(VLOAD(w[4]), *x)), m);
+            m = VANDN(VOR(VLT(*y, VLOAD(w[5])), VLT(VLOAD(w[6]), *y)), m);
+            if (!VMASK(m)) continue;
+
+            // put the centre back on the line
+            pen = VAND(m, pen);
+            *x = VSUB(*x, VMUL(pen, nx));
+            *y = VSUB(*y, VMUL(pen, ny));
+
+            vn = VADD(VMUL(nx, *vx), VMUL(ny, *vy));
+            m = VAND(m, VLT(zero, vn));
+            if (!VMASK(m)) continue;
+
+            // straight cushions damp the normal velocity, tunnel walls the whole one
+            rail = VLT(half, VLOAD(w[7]));
+            vxr = VSUB(*vx, VMUL(VADD(one, dump), VMUL(vn, nx)));
+            vyr = VSUB(*vy, VMUL(VADD(one, dump), VMUL(vn, ny)));
+            vxt = VMUL(dump, VSUB(*vx, VMUL(two, VMUL(vn, nx))));
+            vyt = VMUL(dump, VSUB(*vy, VMUL(two, VMUL(vn, ny))));
+            *vx = VSEL(m, VSEL(rail, vxr, vxt), *vx);
+            *vy = VSEL(m, VSEL(rail, vyr, vyt), *vy);
+
+            bits = VMASK(VAND(m, rail));
+            for (t = 0; bits; t++, bits >>= 1)
+                if (bits & 1) b->s[t]->nbounce++;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_COLLIDE(b, i, j, m):
+// separates and makes collide the i-th and j-th balls of the tables in the mask m,
+// in which they overlap and at least one of them moved, same as handle_collision()
+static void batch_collide(struct batch *b, int i, int j, vfloat m)
+{
+vfloat  zero = VSET(0), half = VSET(0.5), two = VSET(2);
+vfloat  xi = VLOAD(b->x[i]), yi = VLOAD(b->y[i]), xj = VLOAD(b->x[j]), yj = VLOAD(b->y[j]);
+vfloat  dump;                       // dumping factor of each table
+vfloat  vxi, vyi, vxj, vyj;         // velocities before the collision
+vfloat  dx, dy, d2, d, e;           // distance and half of the intersection
+vfloat  nx, ny;                     // normal versor
+vfloat  vni, vti, vnj, vtj;         // normal and tangential velocities
+vfloat  q, A, vm;                   // see bounce()
+int     bits = VMASK(m), t;
+
+        dx = VSUB(xi, xj);
+        dy = VSUB(yi, yj);
+        d2 = VADD(VMUL(dx, dx), VMUL(dy, dy));
+
+        d = VSQRT(VSEL(m, d2, VSET(1)));
+        nx = VDIV(dx, d);
+        ny = VDIV(dy, d);
+        e = VAND(m, VMUL(half, VSUB(VSET(DIAM), d)));
+
+        VSTORE(b->x[i], VADD(xi, VMUL(e, nx)));
+        VSTORE(b->y[i], VADD(yi, VMUL(e, ny)));
+        VSTORE(b->x[j], VSUB(xj, VMUL(e, nx)));
+        VSTORE(b->y[j], VSUB(yj, VMUL(e, ny)));
+
+        vxi = VLOAD(b->vx[i]);  vyi = VLOAD(b->vy[i]);
+        vxj = VLOAD(b->vx[j]);  vyj = VLOAD(b->vy[j]);
+
+        // tangent versor (-ny, nx)
+        vni = VADD(VMUL(vxi, nx), VMUL(vyi, ny));
+        vnj = VADD(VMUL(vxj, nx), VMUL(vyj, ny));
+        vti = VSUB(VMUL(vyi, nx), VMUL(vxi, ny));
+        vtj = VSUB(VMUL(vyj, nx), VMUL(vxj, ny));
+
+        dump = VLOAD(b->dump);
+        q = VSUB(VMUL(VSUB(VMUL(two, VMUL(dump, dump)), VSET(1)), VADD(VMUL(vni, vni), VMUL(vnj, vnj))),
+                 VMUL(two, VMUL(vni, vnj)));
+        A = VMUL(half, VSQRT(VAND(VLT(zero, q), q)));
+        vm = VMUL(half, VADD(vni, vnj));
+        vni = VADD(vm, A);
+        vnj = VSUB(vm, A);
+
+        VSTORE(b->vx[i], VSEL(m, VSUB(VMUL(vni, nx), VMUL(vti, ny)), vxi));
+        VSTORE(b->vy[i], VSEL(m, VADD(VMUL(vni, ny), VMUL(vti, nx)), vyi));
+        VSTORE(b->vx[j], VSEL(m, VSUB(VMUL(vnj, nx), VMUL(vtj, ny)), vxj));
+        VSTORE(b->vy[j], VSEL(m, VADD(VMUL(vnj, ny), VMUL(vtj, nx)), vyj));
+
+        // remember which ball the cue ball touches first
+        if (i == SIM_CUE) {
+            for (t = 0; bits; t++, bits >>= 1)
+                if ((bits & 1) && b->s[t]->first_hit < 0) b->s[t]->first_hit = j;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// BATCH_STEP(b):
+// one fixed step of every table of the block; returns the mask of the lanes whose
+// table is still moving
+static int batch_step(struct batch *b)
+{
+vfloat  zero = VSET(0), half = VSET(0.5);
+vfloat  len = VLOAD(b->len), decay = VLOAD(b->decay), thres = VLOAD(b->thres);
+vfloat  hp2 = VLOAD(b->hp2);
+vfloat  x, y, vx, vy, act, m, dx, dy, d2;
+vfloat  mov[SIM_BATCH_BALLS];       // balls moving before the collisions
+vfloat  on[SIM_BATCH_BALLS];        // balls on the table
+int     i, j, h, t, bits;
+int     live = 0;                   // tables still moving
+
+        for (i = 0; i < b->n; i++) {
+
+            x = VLOAD(b->x[i]);     y = VLOAD(b->y[i]);
+            vx = VLOAD(b->vx[i]);   vy = VLOAD(b->vy[i]);
+            act = VLT(half, VLOAD(b->act[i]));
+            on[i] = act;
+
+            // a ball asleep on every table has nothing to do
+            m = VLT(zero, VADD(VABS(vx), VABS(vy)));
+            if (!VMASK(m)) {
+                mov[i] = zero;
+                continue;
+            }
+
+            // holes, for the moving balls outside the band
+            m = VAND(batch_out(b, x, y, act), m);
+            if (VMASK(m)) {
+                for (h = 0; h < N_HOLES; h++) {
+                    dx = VSUB(x, VLOAD(b->hole[h][0]));
+                    dy = VSUB(y, VLOAD(b->hole[h][1]));
+                    bits = VMASK(VAND(m, VLT(VADD(VMUL(dx, dx), VMUL(dy, dy)), hp2)));
+                    for (t = 0; bits; t++, bits >>= 1)
+                        if (bits & 1) batch_pocket(b, i, h, t);
+                }
+                x = VLOAD(b->x[i]);     y = VLOAD(b->y[i]);
+                vx = VLOAD(b->vx[i]);   vy = VLOAD(b->vy[i]);
+                act = VLT(half, VLOAD(b->act[i]));
+                on[i] = act;
+            }
+
+            // pocketed balls and empty lanes have zero velocity
+            x = VADD(x, VMUL(vx, len));
+            y = VADD(y, VMUL(vy, len));
+            vx = VMUL(vx, decay);
+            vy = VMUL(vy, decay);
+
+            m = batch_out(b, x, y, act);
+            if (VMASK(m)) batch_walls(b, &x, &y, &vx, &vy, m);
+
+            VSTORE(b->x[i], x);     VSTORE(b->y[i], y);
+            VSTORE(b->vx[i], vx);   VSTORE(b->vy[i], vy);
+
+            mov[i] = VAND(act, VLT(zero, VADD(VABS(vx), VABS(vy))));
+        }
+
+        // each pair once, where at least one of the balls moves
+        for (i = 0; i < b->n; i++) {
+            for (j = i + 1; j < b->n; j++) {
+
+                m = VOR(mov[i], mov[j]);
+                if (!VMASK(m)) continue;
+
+                dx = VSUB(VLOAD(b->x[i]), VLOAD(b->x[j]));
+                dy = VSUB(VLOAD(b->y[i]), VLOAD(b->y[j]));
+                d2 = VADD(VMUL(dx, dx), VMUL(dy, dy));
+                m = VAND(m, VAND(VLT(d2, VSET(DIAM*DIAM)), VLT(zero, d2)));
+                if (!VMASK(m)) continue;
+
+                m = VAND(m, VAND(on[i], on[j]));
+                if (VMASK(m)) batch_collide(b, i, j, m);
+            }
+        }
+
+        // slow balls fall asleep, a table is at rest once all of them are
+        for (i = 0; i < b->n; i++) {
+
+            vx = VLOAD(b->vx[i]);
+            vy = VLOAD(b->vy[i]);
+            m = VAND(VLT(VABS(vx), thres), VLT(VABS(vy), thres));
+            vx = VANDN(m, vx);
+            vy = VANDN(m, vy);
+            VSTORE(b->vx[i], vx);
+            VSTORE(b->vy[i], vy);
+
+            live |= VMASK(VLT(zero, VADD(VABS(vx), VABS(vy))));
+        }
+
+        return live;
+}
+
+#endif
+
+//---------------------------------------------------------------------------------
+// TABLE GEOMETRY
+//---------------------------------------------------------------------------------
+
+#define     R2          0.70710678      // 1 / sqrt(2)
+#define     BIG         1e3             // unbounded cushion extent [m]
+
+//---------------------------------------------------------------------------------
+// SET_WALL(w, nx, ny, c, x0, x1, y0, y1, rail):
+// fills a cushion of the table
+static void set_wall(struct sim_wall *w, float nx, float ny, float c,
+                     float x0, float x1, float y0, float y1, int rail)
+{
+        w->nx = nx;     w->ny = ny;     w->c = c;
+        w->x0 = x0;     w->x1 = x1;
+        w->y0 = y0;     w->y1 = y1;
+        w->rail = rail;
+}
+
+//---------------------------------------------------------------------------------
+// EXACT MODE
+//---------------------------------------------------------------------------------
+// Sums, products, divisions and square roots are correctly rounded by IEEE 754, so
+// only the maths library can give different bits on different machines, as long as
+// the compiler does not fuse products and sums (-ffp-contract=off, see the Makefile).
+
+#define     HALF_PI     1.57079632679489661923
+#define     LN2         0.69314718055994530942
+
+//---------------------------------------------------------------------------------
+// EXACT_SINCOS(a, c, s):
+// cosine and sine of a [rad] with Taylor series on [-pi/4, pi/4], far more precise
+// than a float and independent of the maths library
+static void exact_sincos(double a, double *c, double *s)
+{
+int     q;          // quadrant
+double  x, x2;      // reduced angle and its square
+double  sn, cs;     // sine and cosine of x
+
+        q = (int) floor(a / HALF_PI + 0.5);
+        x = a - q * HALF_PI;
+        x2 = x * x;
+
+        sn = x * (1 - x2/6 * (1 - x2/20 * (1 - x2/42 * (1 - x2/72 * (1 - x2/110 * (1 - x2/156))))));
+        cs = 1 - x2/2 * (1 - x2/12 * (1 - x2/30 * (1 - x2/56 * (1 - x2/90 * (1 - x2/132)))));
+
+        switch (q & 3) {
+            case 0: *c =  cs; *s =  sn; break;
+            case 1: *c = -sn; *s =  cs; break;
+            case 2: *c = -cs; *s = -sn; break;
+            case 3: *c =  sn; *s = -cs; break;
+        }
+}
+
+//---------------------------------------------------------------------------------
+// EXACT_LOG(x):
+// natural logarithm of x > 0 with the series of atanh on a mantissa in
+// [sqrt(1/2), sqrt(2)), frexp() and ldexp() only move the exponent
+static double exact_log(double x)
+{
+int     e;          // binary exponent
+double  u, u2;      // atanh argument and its square
+
+        x = frexp(x, &e);
+        if (x < 0.70710678118654752440) {
+            x *= 2;
+            e--;
+        }
+        u = (x - 1) / (x + 1);
+        u2 = u * u;
+
+        return e * LN2 + 2 * u * (1 + u2 * (1./3 + u2 * (1./5 + u2 * (1./7 + u2 * (1./9 +
+               u2 * (1./11 + u2 * (1./13 + u2 * (1./15 + u2 * (1./17 + u2 / 19)))))))));
+}
+
+//---------------------------------------------------------------------------------
+// EXACT_EXP(x):
+// e^x with the Taylor series on [-ln2 / 2, ln2 / 2], independent of the maths library
+static double exact_exp(double x)
+{
+int     e;          // binary exponent
+
+        e = (int) floor(x / LN2 + 0.5);
+        x -= e * LN2;
+
+        return ldexp(1 + x * (1 + x/2 * (1 + x/3 * (1 + x/4 * (1 + x/5 * (1 + x/6 * (1 + x/7 *
+                     (1 + x/8 * (1 + x/9 * (1 + x/10 * (1 + x/11 * (1 + x/12))))))))))), e);
+}
+
+//---------------------------------------------------------------------------------
+// FNV(h, p, n):
+// adds n 32 bit words from p to the hash h, FNV-1a taking a word at a time
+static unsigned fnv(unsigned h, const void *p, int n)
+{
+const unsigned *w = p;
+int     k;
+
+        for (k = 0; k < n; k++) {
+            h ^= w[k];
+            h *= 16777619u;
+        }
+        return h;
+}
+
+//---------------------------------------------------------------------------------
+// FUNCTIONS
+//---------------------------------------------------------------------------------
+
+//---------------------------------------------------------------------------------
+// SIM_INIT(s, n, f, dump):
+// initializes an empty table with n still balls, holes, friction and dumping factors
+void sim_init(struct sim_state *s, int n, float f, float dump)
+{
+int     i, c;   // ball and grid cell indexes
+
+        if (n > SIM_MAX_BALLS) n = SIM_MAX_BALLS;
+
+        s->n = n;
+        s->f = f;
+        s->dump = dump;
+        s->mode = SIM_STEPPED;
+        s->exact = 0;
+        s->hash = SIM_HASH0;
+        s->solver = 0;
+        s->ncontact = s->nwarm = 0;
+        s->pool.n = 1;
+        s->thres = SIM_THRES;
+
+        for (i = 0; i < SIM_MAX_BALLS; i++) {
+            s->x[i] = s->y[i] = 0;
+            s->vx[i] = s->vy[i] = 0;
+            s->xo[i] = s->yo[i] = 0;
+            s->active[i] = (i < n);
+            s->awake[i] = 0;
+        }
+
+        // every ball starts asleep
+        s->n_awake = 0;
+        s->rest_dirty = 1;
+        s->moves = 0;
+
+        sim_set_table(s, LX, LY, HC, HP);
+
+        // empty broad phase grids
+        s->grid.gen = 0;
+        s->rest_grid.gen = 0;
+        for (c = 0; c < SIM_GX * SIM_GY; c++) s->grid.stamp[c] = s->rest_grid.stamp[c] = 0;
+
+        sim_clear_events(s);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_SET_THREADS(s, n):
+// solves the contacts with n threads, the caller included (1 = no worker threads);
+// returns the number of threads actually started
+int sim_set_threads(struct sim_state *s, int n)
+{
+struct sim_pool *p = &s->pool;
+int     t;          // thread index
+
+        // stop the current workers
+        if (p->n > 1) {
+            run_job(s, JOB_QUIT);
+            for (t = 1; t < p->n; t++) pthread_join(p->th[t], NULL);
+            pthread_barrier_destroy(&p->bar);
+            pthread_mutex_destroy(&p->lock);
+        }
+
+        p->n = 1;
+        p->s = s;
+        if (n > SIM_MAX_THREADS) n = SIM_MAX_THREADS;
+        if (n <= 1) return 1;
+
+        // the workers wait on the lock until the barrier knows how many they are
+        p->next_id = 0;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_mutex_lock(&p->lock);
+
+        for (t = 1; t < n; t++) {
+            if (pthread_create(&p->th[t], NULL, worker, p) != 0) break;
+        }
+
+        p->n = t;
+        if (t > 1) pthread_barrier_init(&p->bar, NULL, t);
+        pthread_mutex_unlock(&p->lock);
+
+        if (t == 1) pthread_mutex_destroy(&p->lock);
+        return t;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_SET_TABLE(s, lx, ly, hc, hp):
+// sets the table size, rebuilding the holes, cushions and grid cells
+void sim_set_table(struct sim_state *s, float lx, float ly, float hc, float hp)
+{
+struct sim_wall *w = s->wall;
+float   R = DIAM / 2;       // ball radius
+float   m;                  // width of the cushion band [m]
+
+        s->table.lx = lx;
+        s->table.ly = ly;
+        s->table.hc = hc;
+        s->table.hp = hp;
+
+        // upper left, upper middle, upper right hole
+        s->hole[0].x = - hc;        s->hole[0].y = - hc;
+        s->hole[1].x = lx/2;        s->hole[1].y = - hc;
+        s->hole[2].x = lx + hc;     s->hole[2].y = - hc;
+
+        // lower right, lower middle, lower left hole
+        s->hole[3].x = lx + hc;     s->hole[3].y = ly + hc;
+        s->hole[4].x = lx/2;        s->hole[4].y = ly + hc;
+        s->hole[5].x = - hc;        s->hole[5].y = ly + hc;
+
+        s->hp2 = hp * hp;
+
+        // straight cushions, interrupted by the hole gaps
+        set_wall(w++, -1,  0, - R,      -BIG, BIG, hp - R, ly - hp + R, 1);                 // left
+        set_wall(w++,  1,  0, lx - R,   -BIG, BIG, hp - R, ly - hp + R, 1);                 // right
+        set_wall(w++,  0, -1, - R,      hp - R, lx/2 - hp + R, -BIG, BIG, 1);               // upper left
+        set_wall(w++,  0, -1, - R,      lx/2 + hp - R, lx - hp + R, -BIG, BIG, 1);          // upper right
+        set_wall(w++,  0,  1, ly - R,   hp - R, lx/2 - hp + R, -BIG, BIG, 1);               // lower left
+        set_wall(w++,  0,  1, ly - R,   lx/2 + hp - R, lx - hp + R, -BIG, BIG, 1);          // lower right
+
+        // For each of the corner holes there is a short tunnel that leads to the hole,
+        // right and left wall (ball perspective)
+        set_wall(w++,  R2, -R2,  R2 * (hp - R),             -BIG, hp, -BIG, R, 0);          // left-upper
+        set_wall(w++, -R2,  R2,  R2 * (hp - R),             -BIG, R, -BIG, hp, 0);
+        set_wall(w++, -R2, -R2, -R2 * (ly - hp + R),        -BIG, R, ly - hp, BIG, 0);      // left-lower
+        set_wall(w++,  R2,  R2,  R2 * (ly + hp - R),        -BIG, hp, ly - R, BIG, 0);
+        set_wall(w++,  R2,  R2,  R2 * (lx + hp - R),        lx - R, BIG, -BIG, hp, 0);      // right-upper
+        set_wall(w++, -R2, -R2, -R2 * (lx - hp + R),        lx - hp, BIG, -BIG, R, 0);
+        set_wall(w++, -R2,  R2, -R2 * (lx - ly - hp + R),   lx - hp, BIG, ly - R, BIG, 0);  // right-lower
+        set_wall(w++,  R2, -R2,  R2 * (lx - ly + hp - R),   lx - R, BIG, ly - hp, BIG, 0);
+
+        // every cushion lies within a radius of the field bounds, every hole within
+        // hp - hc (the holes are hc outside the bounds)
+        m = (hp - hc > R) ? hp - hc : R;
+        s->band_x0 = m;     s->band_x1 = lx - m;
+        s->band_y0 = m;     s->band_y1 = ly - m;
+
+        // grid cells of one diameter, larger if the grid would not cover the table
+        s->cell = DIAM;
+        if ((lx + 2*DIAM) / SIM_GX > s->cell) s->cell = (lx + 2*DIAM) / SIM_GX;
+        if ((ly + 2*DIAM) / SIM_GY > s->cell) s->cell = (ly + 2*DIAM) / SIM_GY;
+        s->rest_dirty = 1;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_RACK(s):
+// places the balls in the break formation and the cue ball on its spot
+void sim_rack(struct sim_state *s)
+{
+int     i;          // ball index
+float   a, r, f;    // these parameters define the relative position of the balls
+float   sx, sy;     // scale of the table from the default one
+
+        f = 1.1;    // defines the distance among balls keeping the formation
+        a = f * sqrt(3) * DIAM/2;
+        r = f * DIAM/2;
+
+        // Spots scale with the table, the parking area stays beside it
+        sx = s->table.lx / LX;
+        sy = s->table.ly / LY;
+
+        // White ball
+        s->x[0] = s->xo[0] = B0SX * sx;
+        s->y[0] = s->yo[0] = B0SY * sy;
+
+        // Balls 1 to 8 are parked in the first column, 9 to 15 in the second one and so
+        // on; balls past the triangle are left where they are
+        for (i = 1; i < s->n; i++) {
+            if (i < RACK_BALLS) {
+                s->x[i] = B1SX * sx + rack_col[i] * a;
+                s->y[i] = B1SY * sy + rack_row[i] * r;
+            }
+            s->xo[i] = B1EX + (s->table.lx - LX) + 2*DIAM * ((i - 1) / 8);
+            s->yo[i] = B1EY + 2*DIAM * ((i - 1) % 8);
+        }
+
+        // All balls start still, active and asleep
+        for (i = 0; i < s->n; i++) {
+            s->vx[i] = 0;
+            s->vy[i] = 0;
+            s->active[i] = 1;
+            s->awake[i] = 0;
+        }
+
+        s->n_awake = 0;
+        s->rest_dirty = 1;
+        s->moves++;
+        s->hash = SIM_HASH0;
+        s->ncontact = s->nwarm = 0;
+
+        sim_clear_events(s);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_SHOOT(s, theta, v):
+// gives the cue ball a velocity v [m/s] along the direction theta [rad]
+void sim_shoot(struct sim_state *s, float theta, float v)
+{
+double  c, sn;  // cosine and sine of theta
+
+        if (s->exact) exact_sincos(theta, &c, &sn);
+        else {
+            c = cos(theta);
+            sn = sin(theta);
+        }
+
+        s->vx[SIM_CUE] = v * c;
+        s->vy[SIM_CUE] = v * sn;
+        wake_ball(s, SIM_CUE);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_WAKE(s, i):
+// wakes the i-th ball up, to be called after changing its velocity from outside
+void sim_wake(struct sim_state *s, int i)
+{
+        wake_ball(s, i);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_PLACE(s, i, x, y):
+// puts the i-th ball back on the table, still, at (x, y) [m]
+void sim_place(struct sim_state *s, int i, float x, float y)
+{
+        sleep_ball(s, i);
+        s->active[i] = 1;
+        s->x[i] = x;
+        s->y[i] = y;
+        s->rest_dirty = 1;
+        s->moves++;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_PARK(s, i):
+// takes the i-th ball off the table to its parking position, no event is recorded
+void sim_park(struct sim_state *s, int i)
+{
+        sleep_ball(s, i);
+        s->active[i] = 0;
+        s->x[i] = s->xo[i];
+        s->y[i] = s->yo[i];
+        s->rest_dirty = 1;
+        s->moves++;
+}
+
+//---------------------------------------------------------------------------------
+// STEP(s, dt):
+// one fixed integration step of dt seconds; friction slows the balls as v0 exp(-k t),
+// so in dt they travel v0 (1 - exp(-k dt)) / k whatever the step length
+static void step(struct sim_state *s, float dt)
+{
+int     l;                      // position in the awake list
+int     list[SIM_MAX_BALLS];    // balls awake before the collisions
+int     count;                  // number of balls in list
+double  k;                      // friction rate [1/s]
+double  decay;                  // friction decay exp(-k dt)
+
+        s->moves++;
+
+        handle_holes(s);
+
+        if (s->f <= 0) k = 0;
+        else if (s->exact) k = - exact_log(1 - s->f) / SIM_T_REF;
+        else k = friction_rate(s->f);
+        decay = s->exact ? exact_exp(- k * dt) : exp(- k * dt);
+
+        update_status(s, (k > 0) ? (1 - decay) / k : dt, decay);
+
+        for (l = 0; l < s->n_awake; l++)
+            handle_bounce(s, s->wake_list[l]);
+
+        // the collisions wake balls up, so they work on a copy of the list
+        count = s->n_awake;
+        memcpy(list, s->wake_list, count*sizeof(int));
+
+        // each candidate pair is resolved once per step
+        if (s->n < SIM_GRID_MIN) handle_all_pairs(s, list, count);
+        else handle_pairs(s, list, count);
+
+        if (s->solver) solve_contacts(s);
+
+        sleep_still(s);
+
+        if (s->exact) s->hash = sim_hash(s, s->hash);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_STEP(s, dt, n_steps):
+// advances the table by n_steps integration steps of dt seconds each
+void sim_step(struct sim_state *s, float dt, int n_steps)
+{
+int     k;      // step index
+
+        // the event engine needs exp() and log(), which are not exact
+        if (s->mode == SIM_EVENTS && !s->exact) {
+            advance_events(s, (double) dt * n_steps, friction_rate(s->f));
+            return;
+        }
+
+        for (k = 0; k < n_steps && s->n_awake > 0; k++)
+            step(s, dt);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_SUBSTEPS(s, dt):
+// returns the number of substeps (a power of two) in which dt has to be split so
+// that no awake ball moves more than SIM_CFL diameters in one of them
+int sim_substeps(const struct sim_state *s, float dt)
+{
+int     l, i;       // position in the awake list, ball index
+int     m = 1;      // number of substeps
+float   v, vmax = 0;    // speed and top speed [m/s]
+
+        for (l = 0; l < s->n_awake; l++) {
+            i = s->wake_list[l];
+            v = fabs(s->vx[i]) + fabs(s->vy[i]);    // not less than the speed
+            if (v > vmax) vmax = v;
+        }
+
+        while (vmax * dt / m > SIM_CFL * DIAM && m < SIM_MAX_SUBSTEPS) m *= 2;
+        return m;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_ADVANCE(s, dt):
+// advances the table by dt seconds, one step of the fixed step engine, split in as
+// many substeps as the top speed requires; friction is defined per unit time, so
+// slowing does not depend on the number of substeps. Returns the number of substeps done
+int sim_advance(struct sim_state *s, float dt)
+{
+int     m;          // number of substeps
+int     k;          // substep index
+
+        if (s->mode == SIM_EVENTS && !s->exact) {
+            sim_step(s, dt, 1);
+            return 1;
+        }
+
+        m = sim_substeps(s, dt);
+
+        for (k = 0; k < m && s->n_awake > 0; k++)
+            step(s, dt / m);
+
+        return m;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_HASH(s, h):
+// returns the FNV-1a hash of the balls state (positions, velocities, active flags),
+// chained to the hash h
+unsigned sim_hash(const struct sim_state *s, unsigned h)
+{
+        h = fnv(h, &s->n, 1);
+        h = fnv(h, s->x, s->n);
+        h = fnv(h, s->y, s->n);
+        h = fnv(h, s->vx, s->n);
+        h = fnv(h, s->vy, s->n);
+        h = fnv(h, s->active, s->n);
+
+        return h;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_AT_REST(s, thres):
+// returns 1 if every awake ball moves slower than thres [m/s], 0 otherwise
+int sim_at_rest(const struct sim_state *s, float thres)
+{
+int     l, i;
+
+        // sleeping and pocketed balls are still, no need to check them
+        for (l = 0; l < s->n_awake; l++) {
+            i = s->wake_list[l];
+            if (fabs(s->vx[i]) >= thres || fabs(s->vy[i]) >= thres) return 0;
+        }
+
+        return 1;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_RUN_UNTIL_REST(s, dt, thres, max_steps):
+// steps the table until it is at rest or max_steps have been done,
+// returns the number of steps done
+int sim_run_until_rest(struct sim_state *s, float dt, float thres, int max_steps)
+{
+int     k;          // steps or impacts done
+int     l, i;       // position in the awake list, ball index
+double  rate;       // friction rate [1/s]
+float   v2, vmax;   // squared and maximum speed [m/s]
+
+        if (s->mode == SIM_EVENTS && !s->exact) {
+
+            rate = friction_rate(s->f);
+
+            // jump to the time the fastest ball slows under thres, impacts may
+            // speed some ball up so check again
+            for (k = 0; k < max_steps && !sim_at_rest(s, thres); ) {
+
+                vmax = 0;
+                for (l = 0; l < s->n_awake; l++) {
+                    i = s->wake_list[l];
+                    v2 = s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i];
+                    if (v2 > vmax*vmax) vmax = sqrt(v2);
+                }
+
+                // without friction only the cushions can stop the balls
+                if (rate <= 0) {
+                    k += advance_events(s, (double) dt * max_steps, 0);
+                    break;
+                }
+
+                k += advance_events(s, log(vmax / thres) / rate + dt, rate);
+            }
+
+            return k;
+        }
+
+        for (k = 0; k < max_steps && !sim_at_rest(s, thres); k++)
+            sim_step(s, dt, 1);
+
+        return k;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_RANK_SHOTS(s, work, shot, n, top_k, value):
+// scores the n candidate shots with a coarse rollout from the state s, which is not
+// changed, then plays the top_k best ones again on the copy work with the fixed step
+// engine; shot[] is sorted by score, best first
+void sim_rank_shots(const struct sim_state *s, struct sim_state *work,
+                    struct sim_shot *shot, int n, int top_k, const float *value)
+{
+int     c, i, st;   // candidate, ball and step indexes
+
+        for (c = 0; c < n; c++)
+            shot[c].coarse = shot[c].score = coarse_rollout(s, shot[c].theta, shot[c].v, value);
+
+        qsort(shot, n, sizeof(shot[0]), cmp_shot);
+        if (top_k > n) top_k = n;
+
+        for (c = 0; c < top_k; c++) {
+
+            *work = *s;
+            work->pool.n = 1;       // the workers of s belong to s
+            work->mode = SIM_STEPPED;
+            sim_clear_events(work);
+
+            sim_shoot(work, shot[c].theta, shot[c].v);
+            for (st = 0; st * SIM_T_REF < SIM_ROLL_T && !sim_at_rest(work, work->thres); st++)
+                sim_advance(work, SIM_T_REF);
+
+            shot[c].score = (work->first_hit < 0) ? -1 : 0;
+            for (i = 0; i < work->npocket; i++) {
+                if (value) shot[c].score += value[work->pocket[i].ball];
+                else shot[c].score += (work->pocket[i].ball == SIM_CUE) ? -2 : 1;
+            }
+        }
+
+        qsort(shot, top_k, sizeof(shot[0]), cmp_shot);
+}
+
+//---------------------------------------------------------------------------------
+// SIM_SIMULATE_BATCH(state, shot, n, dt, max_steps):
+// plays shot[t] on the table *state[t] for each of the n tables, with steps of dt
+// seconds, until it is at rest or max_steps have been done; SIM_LANES tables at a
+// time are stepped in lockstep, the others (exact or event mode, more balls than
+// SIM_BATCH_BALLS) one by one. Returns the steps done by all the tables
+long sim_simulate_batch(struct sim_state *state[], const struct sim_shot shot[], int n,
+                        float dt, int max_steps)
+{
+struct sim_state *s;
+long    steps = 0;
+int     k;          // table index
+#if SIM_LANES > 1
+struct batch b;             // lanes of the batch
+int     next = 0;           // next table to load in a lane
+int     t, used, live;      // lane index, lanes in use and still moving
+#endif
+
+        for (k = 0; k < n; k++) {
+
+            s = state[k];
+            sim_shoot(s, shot[k].theta, shot[k].v);
+
+#if SIM_LANES > 1
+            if (s->n <= SIM_BATCH_BALLS && !s->exact && s->mode == SIM_STEPPED) continue;
+#endif
+            steps += sim_run_until_rest(s, dt, s->thres, max_steps);
+        }
+
+#if SIM_LANES > 1
+        memset(&b, 0, sizeof(b));
+
+        do {
+            // give the next tables to the empty lanes
+            for (t = 0; t < SIM_LANES; t++) {
+                while (b.s[t] == NULL && next < n) {
+                    s = state[next++];
+                    if (s->n <= SIM_BATCH_BALLS && !s->exact && s->mode == SIM_STEPPED && !sim_at_rest(s, s->thres))
+                        batch_load(&b, t, s, dt);
+                }
+            }
+
+            used = 0;
+            for (t = 0; t < SIM_LANES; t++)
+                if (b.s[t] != NULL) used |= 1 << t;
+            if (!used) break;
+
+            live = batch_step(&b);
+
+            // tables at rest or out of steps leave their lane
+            for (t = 0; t < SIM_LANES; t++) {
+                if (!(used >> t & 1)) continue;
+                b.steps[t]++;
+                if ((live >> t & 1) && b.steps[t] < max_steps) continue;
+                steps += b.steps[t];
+                batch_store(&b, t);
+            }
+        } while (1);
+#endif
+
+        return steps;
+}
+
+//---------------------------------------------------------------------------------
+// SIM_CLEAR_EVENTS(s):
+// clears the events recorded by the previous steps
+void sim_clear_events(struct sim_state *s)
+{
+        s->nbounce = 0;
+        s->first_hit = -1;
+        s->npocket = 0;
+}
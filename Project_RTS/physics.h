@@ -0,0 +1,272 @@
+//---------------------------------------------------------------------------------
+// PHYSICS LIBRARY HEADER
+//---------------------------------------------------------------------------------
+
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include <pthread.h>
+
+//---------------------------------------------------------------------------------
+// GLOBAL CONSTANTS
+//---------------------------------------------------------------------------------
+
+#define     SIM_MAX_BALLS   1024        // Maximum number of balls on a table (multiple of 8)
+#define     SIM_CUE         0           // Index of the cue (white) ball
+
+#define     SIM_STEPPED     0           // Engine mode: fixed step Euler integration
+#define     SIM_EVENTS      1           // Engine mode: jump from one impact to the next
+#define     SIM_MAX_EVENTS  1000        // Maximum number of impacts resolved in one step
+#define     SIM_GRID_MIN    64          // Balls from which the grid broad phase replaces the all-pairs test
+#define     SIM_THRES       1e-3        // Default speed under which a ball falls asleep [m/s]
+#define     SIM_MAX_CONTACTS (3 * SIM_MAX_BALLS) // Contacts in a step (a ball touches at most 6 others)
+#define     SIM_ITERS       8           // Contact solver iterations per step
+#define     SIM_MAX_THREADS 16          // Maximum number of threads solving the contacts
+#define     SIM_MAX_COLORS  32          // Batches of independent contacts (the last one is solved serially)
+#define     SIM_PAR_MIN     256         // Contacts from which the solver uses the worker threads
+#define     SIM_T_REF       0.04        // Time in which friction takes the fraction f of the speed [s]
+#define     SIM_CFL         0.25        // Largest move of a ball in a substep, in diameters
+#define     SIM_MAX_SUBSTEPS 64         // Largest number of substeps of sim_advance() (power of two)
+#define     SIM_BATCH_BALLS 16          // Largest table stepped in lockstep by sim_simulate_batch()
+#define     SIM_ROLL_T      30          // Longest shot simulated by sim_rank_shots() [s]
+#define     SIM_HASH0       2166136261u // Initial state hash (FNV-1a offset basis)
+#define     SIM_N_WALLS     14          // Cushions: 6 straight rails and 2 walls for each corner tunnel
+
+#define     N_HOLES     6           // number of holes in the table
+#define     DIAM        0.055       // diameter of a ball [m]
+
+// Default table, the one drawn by the game (see sim_set_table for other sizes)
+#define     LX          1.77        // width of field in x direction [m]
+#define     LY          0.85        // width of field in y direction [m]
+#define     HC          0.035       // parameter that defines holes position [m]
+#define     HP          0.065       // parameter that defines the gap in the table bounds [m]
+
+#define     B0SX        0.425       // white ball spawn coordinate x [m]
+#define     B0SY        0.425       // white ball spawn coordinate y [m]
+#define     B1SX        1.345       // ball 1 spawn coordinate x [m]
+#define     B1SY        0.425       // ball 1 spawn coordinate y [m]
+#define     B1EX        1.94        // ball 1 eliminated coordinate x [m]
+#define     B1EY        0           // ball 1 eliminated coordinate y [m]
+
+// Broad phase grid: cells of one ball diameter covering the default field (LX / DIAM by
+// LY / DIAM) plus the margin where the balls run into the holes; on larger tables the
+// cells grow to keep the same number
+#define     SIM_GX      35          // number of grid cells along x
+#define     SIM_GY      18          // number of grid cells along y
+
+#define     SIM_ALIGN       __attribute__ ((aligned (32)))  // Alignment of the ball arrays (one AVX register)
+
+//---------------------------------------------------------------------------------
+// STRUCTURES
+//---------------------------------------------------------------------------------
+
+// Hole position
+struct sim_hole {
+    float   x, y;           // Hole centre [m]
+};
+
+// Table size
+struct sim_table {
+    float   lx, ly;         // Width of field in x and y direction [m]
+    float   hc;             // Distance of the holes centre from the field corners and sides [m]
+    float   hp;             // Gap in the table bounds, also the radius of a hole [m]
+};
+
+// Cushion seen by the ball centre: the region beyond the line nx*x + ny*y = c inside
+// the box [x0, x1] x [y0, y1], entered while moving along the outward normal (nx, ny)
+struct sim_wall {
+    float   nx, ny, c;      // Outward normal and line offset [m]
+    float   x0, x1;         // Extent along x [m]
+    float   y0, y1;         // Extent along y [m]
+    int     rail;           // 1 = straight cushion, 0 = wall of a corner tunnel
+};
+
+// Pocketing event
+struct sim_pocket {
+    int     ball;           // Index of the pocketed ball
+    int     hole;           // Index of the hole it fell in
+};
+
+// Uniform grid used to find the candidate colliding pairs, rebuilt at every step:
+// each cell holds a list of balls, valid only if its stamp matches the current build
+struct sim_grid {
+    unsigned    gen;                        // Current build number
+    unsigned    stamp[SIM_GX * SIM_GY];     // Build in which each cell was last filled
+    int     head[SIM_GX * SIM_GY];          // First ball of each cell (-1 = none)
+    int     next[SIM_MAX_BALLS];            // Next ball in the same cell (-1 = none)
+    int     cell[SIM_MAX_BALLS];            // Cell of each ball (-1 if not in the grid)
+};
+
+// Contact between two balls found in a step, i < j
+struct sim_contact {
+    int     i, j;           // Indexes of the balls
+    float   nx, ny;         // Normal versor pointing from the j-th to the i-th ball
+    float   target;         // Normal velocity to reach after the impact [m/s]
+    float   imp;            // Normal impulse accumulated by the solver [m/s]
+};
+
+// Candidate shot for sim_rank_shots()
+struct sim_shot {
+    float   theta, v;       // Direction [rad] and velocity [m/s] of the cue ball
+    float   coarse;         // Score of the coarse rollout
+    float   score;          // Score of the full engine for the best candidates, else the coarse one
+};
+
+// Worker threads of the contact solver: the caller and n - 1 workers meet at the
+// barrier before and after each job, and between the batches of a job
+struct sim_pool {
+    int     n;                              // Threads solving, the caller included (1 = no workers)
+    int     job;                            // Job of the workers
+    int     next_id;                        // Index of the last worker started
+    pthread_t   th[SIM_MAX_THREADS];
+    pthread_mutex_t     lock;               // Held while the workers are being started
+    pthread_barrier_t   bar;
+    struct  sim_state   *s;                 // Table being solved
+    float   dmax[SIM_MAX_THREADS];          // Largest change found by each thread in an iteration
+};
+
+// Table state: everything the physics needs to advance a shot. Ball data is
+// kept as separate aligned arrays so the kernels can load a vector of balls at
+// once; a pocketed ball always has zero velocity, entries past n are all zero.
+struct sim_state {
+    int     n;                              // Number of balls in use
+
+    // Hot data, read and written by every step
+    SIM_ALIGN float x[SIM_MAX_BALLS];       // Position [m]
+    SIM_ALIGN float y[SIM_MAX_BALLS];
+    SIM_ALIGN float vx[SIM_MAX_BALLS];      // Velocity [m/s]
+    SIM_ALIGN float vy[SIM_MAX_BALLS];
+
+    // Cold data
+    int     active[SIM_MAX_BALLS];          // 1 while the ball is on the table, 0 once pocketed
+    float   xo[SIM_MAX_BALLS];              // Parking position once pocketed [m]
+    float   yo[SIM_MAX_BALLS];
+    unsigned long   moves;                  // Bumped by every step moving the balls and every ball
+                                            // placed, parked or racked: two states with the same
+                                            // count have the balls in the same places
+
+    // Awake set: only moving balls are integrated and tested, a still ball
+    // sleeps until an awake ball touches it
+    int     awake[SIM_MAX_BALLS];           // 1 if the ball is awake, 0 if it sleeps or is pocketed
+    int     wake_list[SIM_MAX_BALLS];       // Awake balls, sorted by index
+    int     n_awake;                        // Number of awake balls
+    float   thres;                          // Speed under which a ball falls asleep [m/s]
+
+    // Geometry, built from the table size by sim_set_table()
+    struct  sim_table   table;
+    struct  sim_hole    hole[N_HOLES];
+    struct  sim_wall    wall[SIM_N_WALLS];
+    float   hp2;                            // Squared hole radius [m^2]
+    float   band_x0, band_x1;               // A ball whose centre is inside this box cannot
+    float   band_y0, band_y1;               // touch any cushion or hole [m]
+    float   cell;                           // Side of a broad phase grid cell [m]
+
+    float   f;                              // Fraction of speed lost to friction every SIM_T_REF
+    float   dump;                           // Bounds bouncing dumping factor
+    int     mode;                           // Engine mode: SIM_STEPPED or SIM_EVENTS
+
+    // Contact solver: the contacts of a fixed step are gathered and solved together,
+    // starting from the impulses of the previous step
+    int     solver;                         // 1 = solve the contacts together, 0 = one by one
+    int     ncontact;                       // Contacts of the last step
+    struct  sim_contact contact[SIM_MAX_CONTACTS];
+    int     nwarm;                          // Contacts of the step before, for the warm start
+    struct  sim_contact warm[SIM_MAX_CONTACTS];
+
+    // Parallel solver: contacts sharing no ball are put in the same batch (color),
+    // the contacts of a batch are split among the threads
+    int     ncolor;                         // Number of batches
+    int     color_start[SIM_MAX_COLORS + 1];// First entry of each batch in order[]
+    int     order[SIM_MAX_CONTACTS];        // Contacts grouped by batch
+    struct  sim_pool    pool;
+
+    // Bit-reproducible mode: the fixed step engine with basic arithmetic only, in
+    // a fixed order, so the same inputs give the same bits on every run and machine
+    int     exact;                          // 1 = bit-reproducible mode (SIM_EVENTS is ignored)
+    unsigned    hash;                       // State hashes chained after every step (exact mode)
+
+    // Events recorded since the last sim_clear_events()
+    int     nbounce;                        // Bounces on the straight cushions
+    int     first_hit;                      // First ball touched by the cue ball (-1 = none)
+    int     npocket;                        // Number of pocketing events
+    struct  sim_pocket  pocket[SIM_MAX_BALLS];
+
+    struct  sim_grid    grid;               // Broad phase grid of the awake balls, rebuilt every step
+    struct  sim_grid    rest_grid;          // Broad phase grid of the sleeping balls
+    int     rest_dirty;                     // 1 if the sleeping balls changed since rest_grid was built
+};
+
+//---------------------------------------------------------------------------------
+// FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------
+
+// initializes an empty default table with n still balls, holes, friction and dumping factors
+void sim_init(struct sim_state *s, int n, float f, float dump);
+
+// sets the table size, rebuilding the holes, cushions and grid cells; the balls
+// are not moved, sim_rack() puts them on the spots of the new table
+void sim_set_table(struct sim_state *s, float lx, float ly, float hc, float hp);
+
+// places the balls in the break formation and the cue ball on its spot
+void sim_rack(struct sim_state *s);
+
+// gives the cue ball a velocity v [m/s] along the direction theta [rad]
+void sim_shoot(struct sim_state *s, float theta, float v);
+
+// wakes the i-th ball up, to be called after changing its velocity from outside
+void sim_wake(struct sim_state *s, int i);
+
+// puts the i-th ball back on the table, still, at (x, y) [m]
+void sim_place(struct sim_state *s, int i, float x, float y);
+
+// takes the i-th ball off the table to its parking position, no event is recorded
+void sim_park(struct sim_state *s, int i);
+
+// solves the contacts with n threads, the caller included (1 = no worker threads);
+// the state must stay at the same address while it has workers. Returns the number
+// of threads actually started
+int sim_set_threads(struct sim_state *s, int n);
+
+// advances the table by n_steps integration steps of dt seconds each; in event
+// mode the same time span is covered jumping from one impact to the next
+void sim_step(struct sim_state *s, float dt, int n_steps);
+
+// returns the number of substeps (a power of two) in which dt has to be split so
+// that no awake ball moves more than SIM_CFL diameters in one of them
+int sim_substeps(const struct sim_state *s, float dt);
+
+// advances the table by dt seconds, one fixed step split in as many substeps as
+// the top speed requires; returns the number of substeps done
+int sim_advance(struct sim_state *s, float dt);
+
+// returns the FNV-1a hash of the balls state (positions, velocities, active flags),
+// chained to the hash h
+unsigned sim_hash(const struct sim_state *s, unsigned h);
+
+// returns 1 if every awake ball moves slower than thres [m/s], 0 otherwise
+int sim_at_rest(const struct sim_state *s, float thres);
+
+// steps the table until it is at rest or max_steps have been done,
+// returns the number of steps done (number of impacts in event mode)
+int sim_run_until_rest(struct sim_state *s, float dt, float thres, int max_steps);
+
+// scores the n candidate shots with a coarse rollout from the state s, which is not
+// changed, then plays the top_k best ones again on the copy work with the fixed step
+// engine; shot[] is sorted by score, best first. The score is the sum of value[i] for
+// each pocketed ball i (NULL: -2 for the cue ball, 1 for the others), minus one if the
+// cue ball touches no ball
+void sim_rank_shots(const struct sim_state *s, struct sim_state *work,
+                    struct sim_shot *shot, int n, int top_k, const float *value);
+
+// plays shot[t] on the table *state[t] for each of the n tables, with steps of dt
+// seconds, until it is at rest or max_steps have been done; tables of up to
+// SIM_BATCH_BALLS balls in fixed step mode are stepped in lockstep, one per vector
+// lane, with their own friction and dumping factors (contacts one at a time, as
+// with solver = 0), the others one by one. Returns the steps done by all the tables
+long sim_simulate_batch(struct sim_state *state[], const struct sim_shot shot[], int n,
+                        float dt, int max_steps);
+
+// clears the events recorded by the previous steps
+void sim_clear_events(struct sim_state *s);
+
+#endif // PHYSICS_H
@@ -131,6 +131,10 @@ int tret;
     tp[i].deadline = drel;
     tp[i].priority = prio;
     tp[i].dmiss = 0;
+    tp[i].wcet = 0;
+    tp[i].et = 0;
+    tp[i].et_sum = 0;
+    tp[i].njobs = 0;
 
     pthread_attr_init(&myatt);
 
@@ -250,6 +254,43 @@ int task_dmiss(int i)
     return tp[i].dmiss;
 }
 
+//---------------------------------------------------------------------------------
+// TASK_UPDATE_WCET(i, et):
+// records the execution time et in us of a job, keeping the largest one
+// and the total for the mean
+void task_update_wcet(int i, long et)
+{
+    tp[i].et = et;
+    tp[i].et_sum += et;
+    tp[i].njobs++;
+    if (et > tp[i].wcet) tp[i].wcet = et;
+}
+
+//---------------------------------------------------------------------------------
+// TASK_WCET(i):
+// gets the largest execution time measured in us
+long task_wcet(int i)
+{
+    return tp[i].wcet;
+}
+
+//---------------------------------------------------------------------------------
+// TASK_ET(i):
+// gets the execution time of the last measured job in us
+long task_et(int i)
+{
+    return tp[i].et;
+}
+
+//---------------------------------------------------------------------------------
+// TASK_MEAN_ET(i):
+// gets the mean execution time of the measured jobs in us
+long task_mean_et(int i)
+{
+    if (tp[i].njobs == 0) return 0;
+    return tp[i].et_sum / tp[i].njobs;
+}
+
 //---------------------------------------------------------------------------------
 // TASK_ATIME(i, *at):
 // copies at from tp to timespec structure
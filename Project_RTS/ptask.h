@@ -27,6 +27,9 @@
 struct task_par {
     int         arg;            // Task argument (used to identify task index)
     long        wcet;           // Worst-case execution time (WCET) in microseconds
+    long        et;             // Execution time of the last job in microseconds
+    long long   et_sum;         // Total execution time of the measured jobs in microseconds
+    long        njobs;          // Number of measured jobs
     int         period;         // Task period in milliseconds
     int         deadline;       // Relative deadline in milliseconds
     int         priority;       // Task priority in [0, 99]
@@ -96,6 +99,19 @@ int task_deadline(int i);
 // gets the # of deadline misses
 int task_dmiss(int i);
 
+// records the execution time et in us of a job, keeping the largest one
+// and the total for the mean
+void task_update_wcet(int i, long et);
+
+// gets the largest execution time measured in us
+long task_wcet(int i);
+
+// gets the execution time of the last measured job in us
+long task_et(int i);
+
+// gets the mean execution time of the measured jobs in us
+long task_mean_et(int i);
+
 // copies at from tp to timespec structure
 void task_atime(int i, struct timespec *at);
 